@@ -0,0 +1,79 @@
+//
+// bench.c
+// Micro-benchmarks of the per-block processing kernels, for comparing builds.
+//
+
+#include "bench.h"
+#include "blkring.h"
+#include "loudness.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SECONDS   2       // Minimum time to run each kernel for
+#define BENCH_BLOCKS    8       // Number of blocks in the benchmark ring
+
+#ifdef __386__
+#define BENCH_BUILD     "32-bit protected mode"
+#else
+#define BENCH_BUILD     "16-bit real mode"
+#endif
+
+//
+// Prints the throughput of a kernel in KB/s.
+//
+static void print_rate(const char *name, unsigned long bytes, clock_t elapsed)
+{
+    double seconds = (double) elapsed / CLOCKS_PER_SEC;
+    printf("%-20s%10.0f KB/s\n", name, bytes / 1024.0 / seconds);
+}
+
+//
+// Times the gain kernel and the block ring copy on blocks of the given size,
+// and prints their throughput to stdout.
+//
+void bench_run(unsigned int block_size)
+{
+    unsigned char *block;
+    short *samples;
+    BlockRing ring;
+    unsigned int i;
+    unsigned long bytes;
+    clock_t start, elapsed;
+
+    block = (unsigned char *) malloc(block_size);
+    if (block == NULL || BlockRing_init(&ring, block_size, BENCH_BLOCKS) == 0) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        free(block);
+        return;
+    }
+
+    // Fill the block with a ramp, so the gain kernel does some clipping
+    samples = (short *) block;
+    for (i = 0; i < block_size / 2; i++)
+        samples[i] = (short) (i * 97);
+
+    printf("Build:              %s\n", BENCH_BUILD);
+    printf("Block size:         %u\n", block_size);
+
+    bytes = 0;
+    start = clock();
+    do {
+        Loudness_apply_gain(samples, block_size / 2,
+                            LOUDNESS_UNITY_GAIN + LOUDNESS_UNITY_GAIN / 2);
+        bytes += block_size;
+    } while ((elapsed = clock() - start) < BENCH_SECONDS * CLOCKS_PER_SEC);
+    print_rate("Gain kernel:", bytes, elapsed);
+
+    bytes = 0;
+    start = clock();
+    do {
+        BlockRing_write(&ring, block, block_size);
+        BlockRing_read(&ring, block);
+        bytes += block_size;
+    } while ((elapsed = clock() - start) < BENCH_SECONDS * CLOCKS_PER_SEC);
+    print_rate("Block ring copy:", bytes, elapsed);
+
+    BlockRing_free(&ring);
+    free(block);
+}
@@ -0,0 +1,11 @@
+//
+// bench.h
+// Micro-benchmarks of the per-block processing kernels, for comparing builds.
+//
+
+#ifndef BENCH_H
+#define BENCH_H
+
+void bench_run(unsigned int block_size);
+
+#endif
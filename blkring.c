@@ -0,0 +1,148 @@
+//
+// blkring.c
+// A lock-free single-producer/single-consumer ring of pooled audio blocks.
+//
+
+#include "blkring.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+
+#ifdef __386__
+#define _fmalloc    malloc
+#define _ffree      free
+#define _fmemcpy    memcpy
+#endif
+
+//
+// Allocates the block pool for a ring. The number of blocks must be a power of
+// two so that the head and tail counters can wrap around freely. Return value
+// indicates whether the ring could be allocated.
+//
+int BlockRing_init(BlockRing *ring, unsigned int block_size,
+                   unsigned int num_blocks)
+{
+    if (num_blocks == 0 || num_blocks > BLOCK_RING_MAX_BLOCKS)
+        return 0;
+    if (num_blocks & (num_blocks - 1))
+        return 0;   // Not a power of two
+    if (block_size == 0 || num_blocks > (unsigned int) -1 / block_size)
+        return 0;   // Pool too big to allocate in one piece
+
+    // Allocate all blocks up front, so nothing is allocated while playing
+    ring->pool = (unsigned char BLOCK_FAR *) _fmalloc(block_size * num_blocks);
+    if (ring->pool == NULL)
+        return 0;
+
+    ring->block_size = block_size;
+    ring->num_blocks = num_blocks;
+    ring->head = 0;
+    ring->tail = 0;
+
+    ring->blocks_written = 0;
+    ring->blocks_read = 0;
+    ring->producer_stalls = 0;
+    ring->consumer_stalls = 0;
+    ring->max_occupancy = 0;
+    ring->min_occupancy = num_blocks;
+
+    return 1;
+}
+
+//
+// Frees the block pool of a ring.
+//
+void BlockRing_free(BlockRing *ring)
+{
+    _ffree(ring->pool);
+}
+
+//
+// Returns the number of blocks currently queued in the ring.
+//
+unsigned int BlockRing_get_occupancy(BlockRing *ring)
+{
+    return ring->head - ring->tail;
+}
+
+//
+// Returns whether the ring has no free blocks left.
+//
+int BlockRing_is_full(BlockRing *ring)
+{
+    return BlockRing_get_occupancy(ring) == ring->num_blocks;
+}
+
+//
+// Copies count bytes (at most one block) into the next free block. Must only
+// be called by the producer. Return value indicates failure if the ring is
+// full.
+//
+int BlockRing_write(BlockRing *ring, unsigned char *data, unsigned int count)
+{
+    unsigned int index;
+    unsigned int occupancy;
+
+    occupancy = BlockRing_get_occupancy(ring);
+    if (occupancy == ring->num_blocks)
+        return 0;
+
+    index = ring->head & (ring->num_blocks - 1);
+    _fmemcpy(ring->pool + index * ring->block_size, data, count);
+    ring->counts[index] = count;
+
+    // Publish the block only once its contents are in place
+    ring->head++;
+
+    ring->blocks_written++;
+    if (occupancy + 1 > ring->max_occupancy)
+        ring->max_occupancy = occupancy + 1;
+
+    return 1;
+}
+
+//
+// Copies the oldest queued block to the given buffer and releases it. Must only
+// be called by the consumer. Returns the number of bytes copied, or zero if the
+// ring is empty. Safe to call from an ISR.
+//
+unsigned int BlockRing_read(BlockRing *ring, unsigned char *dest)
+{
+    unsigned int index;
+    unsigned int count;
+    unsigned int occupancy;
+
+    occupancy = BlockRing_get_occupancy(ring);
+    if (occupancy == 0)
+        return 0;
+
+    if (occupancy < ring->min_occupancy)
+        ring->min_occupancy = occupancy;
+
+    index = ring->tail & (ring->num_blocks - 1);
+    count = ring->counts[index];
+    _fmemcpy(dest, ring->pool + index * ring->block_size, count);
+
+    // Hand the block back to the producer only once it has been copied
+    ring->tail++;
+
+    ring->blocks_read++;
+
+    return count;
+}
+
+//
+// Writes the ring statistics to stdout.
+//
+void BlockRing_print(BlockRing *ring)
+{
+    printf("Blocks (size):      %u (%u)\n", ring->num_blocks,
+           ring->block_size);
+    printf("Reader blocks:      %lu\n", ring->blocks_written);
+    printf("Reader stalls:      %lu\n", ring->producer_stalls);
+    printf("Max occupancy:      %u\n", ring->max_occupancy);
+    printf("Output blocks:      %lu\n", ring->blocks_read);
+    printf("Output stalls:      %lu\n", ring->consumer_stalls);
+    printf("Min occupancy:      %u\n", ring->min_occupancy);
+}
@@ -0,0 +1,54 @@
+//
+// blkring.h
+// A lock-free single-producer/single-consumer ring of pooled audio blocks.
+//
+
+#ifndef BLKRING_H
+#define BLKRING_H
+
+#define BLOCK_RING_MAX_BLOCKS   64  // Maximum number of blocks in a ring
+
+// In real mode the block pool lives outside DGROUP, in far memory. In
+// protected mode everything is addressable, and the pool is in extended
+// memory.
+#ifdef __386__
+#define BLOCK_FAR
+#else
+#define BLOCK_FAR __far
+#endif
+
+//
+// Structure holding a ring of fixed-size blocks. One side (the producer) only
+// ever advances head, and the other side (the consumer) only ever advances
+// tail, so the two sides need no locking as long as each index can be written
+// in a single instruction.
+//
+typedef struct {
+    unsigned char BLOCK_FAR *pool;  // Storage for all blocks, allocated once
+    unsigned int block_size;        // Size of each block in bytes
+    unsigned int num_blocks;        // Number of blocks (a power of two)
+    // Bytes held in each block. Volatile so that the compiler can't move a
+    // block's count past the update of head that publishes it.
+    unsigned int volatile counts[BLOCK_RING_MAX_BLOCKS];
+    unsigned int volatile head;     // Blocks written so far (wraps around)
+    unsigned int volatile tail;     // Blocks read so far (wraps around)
+
+    // Statistics
+    unsigned long blocks_written;   // Number of blocks written by producer
+    unsigned long blocks_read;      // Number of blocks read by consumer
+    unsigned long producer_stalls;  // Times the producer found the ring full
+    unsigned long consumer_stalls;  // Times the consumer found the ring empty
+    unsigned int max_occupancy;     // Most blocks seen queued by producer
+    unsigned int min_occupancy;     // Fewest blocks seen queued by consumer
+} BlockRing;
+
+int BlockRing_init(BlockRing *ring, unsigned int block_size,
+                   unsigned int num_blocks);
+void BlockRing_free(BlockRing *ring);
+unsigned int BlockRing_get_occupancy(BlockRing *ring);
+int BlockRing_is_full(BlockRing *ring);
+int BlockRing_write(BlockRing *ring, unsigned char *data, unsigned int count);
+unsigned int BlockRing_read(BlockRing *ring, unsigned char *dest);
+void BlockRing_print(BlockRing *ring);
+
+#endif
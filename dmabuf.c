@@ -7,6 +7,39 @@
 #include <stdlib.h>
 #include <i86.h>
 
+//
+// Returns the physical address of the given pointer into conventional memory.
+//
+static unsigned long get_physical_address(unsigned char *ptr)
+{
+#ifdef __386__
+    // The DOS extender maps the first megabyte one-to-one
+    return (unsigned long) ptr;
+#else
+    return ((unsigned long) FP_SEG(ptr) << 4) + (unsigned long) FP_OFF(ptr);
+#endif
+}
+
+#ifdef __386__
+//
+// Allocates a block of conventional memory (below 1MB, where the DMA
+// controller can reach it) through DPMI. Returns NULL on failure.
+//
+static unsigned char *alloc_dos_memory(DMABuffer *dma_buf, unsigned int size)
+{
+    union REGS regs;
+
+    regs.w.ax = 0x0100;                 // DPMI allocate DOS memory block
+    regs.w.bx = (size + 15) >> 4;       // Size in paragraphs
+    int386(0x31, &regs, &regs);
+    if (regs.x.cflag)
+        return NULL;
+
+    dma_buf->selector = regs.w.dx;
+    return (unsigned char *) ((unsigned long) regs.w.ax << 4);
+}
+#endif
+
 //
 // Allocate a DMA buffer used to store the audio data. Note that the buffer must
 // *not* cross a 64KB boundary.
@@ -19,7 +52,11 @@ int DMABuffer_init(DMABuffer *dma_buf, unsigned int size)
     // Allocate a memory region twice the requested size of the DMA buffer. If
     // one half of the region is not page-aligned, then the other half certainly
     // is.
+#ifdef __386__
+    dma_buf->region = alloc_dos_memory(dma_buf, size * 2);
+#else
     dma_buf->region = (unsigned char *) malloc(size * 2);
+#endif
     if (dma_buf->region == NULL)
         return 0;
 
@@ -27,8 +64,7 @@ int DMABuffer_init(DMABuffer *dma_buf, unsigned int size)
     dma_buf->fill_half = 0;
 
     // Get physical addresses of first and second halves of memory region
-    first = ((unsigned long) FP_SEG(dma_buf->region) << 4) +
-            (unsigned long) FP_OFF(dma_buf->region);
+    first = get_physical_address(dma_buf->region);
     second = first + size;
 
     // Page number is upper nibble of physical address
@@ -51,7 +87,15 @@ int DMABuffer_init(DMABuffer *dma_buf, unsigned int size)
 //
 void DMABuffer_free(DMABuffer *dma_buf)
 {
+#ifdef __386__
+    union REGS regs;
+
+    regs.w.ax = 0x0101;                 // DPMI free DOS memory block
+    regs.w.dx = dma_buf->selector;
+    int386(0x31, &regs, &regs);
+#else
     free(dma_buf->region);
+#endif
 }
 
 //
@@ -67,27 +111,30 @@ unsigned char *DMABuffer_get_buffer_ptr(DMABuffer *dma_buf)
 //
 unsigned long DMABuffer_get_physical_address(DMABuffer *dma_buf)
 {
-    unsigned char *buffer = DMABuffer_get_buffer_ptr(dma_buf);
-    unsigned long phys_addr =
-        ((unsigned long) FP_SEG(buffer) << 4) + (unsigned long) FP_OFF(buffer);
-    return phys_addr;
+    return get_physical_address(DMABuffer_get_buffer_ptr(dma_buf));
 }
 
 //
-// Fills the half of the DMA buffer with sound data from the given file. Return
-// value indicates whether read was successful.
+// Fills the half of the DMA buffer with sound data from the given file, reading
+// at most max_count bytes. Return value indicates whether read was successful.
 //
 int DMABuffer_fill_half_buffer(DMABuffer *dma_buf, FILE *file,
-                               unsigned long *count)
+                               unsigned long max_count, unsigned long *count)
 {
     unsigned char *buffer;
+    unsigned int to_read;
     unsigned long tmp;
 
     buffer = DMABuffer_get_buffer_ptr(dma_buf);
     if (dma_buf->fill_half == 1)
         buffer += dma_buf->size / 2;    // Point to upper half
 
-    tmp = fread(buffer, 1, dma_buf->size / 2, file);
+    // Don't read past the end of the audio data (e.g. into trailing chunks)
+    to_read = dma_buf->size / 2;
+    if (max_count < to_read)
+        to_read = (unsigned int) max_count;
+
+    tmp = fread(buffer, 1, to_read, file);
     if (ferror(file)) {
         // File I/O error
         return 1;
@@ -105,8 +152,12 @@ int DMABuffer_fill_half_buffer(DMABuffer *dma_buf, FILE *file,
 //
 void DMABuffer_print(DMABuffer *dma_buf)
 {
+#ifdef __386__
+    printf("Region (linear):  %lx\n", (unsigned long) dma_buf->region);
+#else
     printf("Region (seg:off): %x:%x\n",
            FP_SEG(dma_buf->region), FP_OFF(dma_buf->region));
+#endif
     printf("Offset:           %u\n", dma_buf->offset);
     printf("Size:             %u\n", dma_buf->size);
     printf("Fill half:        %d\n", dma_buf->fill_half);
@@ -16,6 +16,9 @@ typedef struct {
     unsigned int offset;        // Location of DMA buffer in region
     unsigned int size;          // Size of DMA buffer
     int fill_half;              // Half of buffer to fill next
+#ifdef __386__
+    unsigned short selector;    // DPMI selector of conventional memory block
+#endif
 } DMABuffer;
 
 int DMABuffer_init(DMABuffer *dma_buf, unsigned int size);
@@ -23,7 +26,7 @@ void DMABuffer_free(DMABuffer *dma_buf);
 unsigned char *DMABuffer_get_buffer_ptr(DMABuffer *dma_buf);
 unsigned long DMABuffer_get_physical_address(DMABuffer *dma_buf);
 int DMABuffer_fill_half_buffer(DMABuffer *dma_buf, FILE *file,
-                               unsigned long *count);
+                               unsigned long max_count, unsigned long *count);
 void DMABuffer_print(DMABuffer *dma_buf);
 
 #endif
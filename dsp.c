@@ -25,19 +25,22 @@
 #define DSP_SPEAKER_ON      0xD1    // Turn on speaker
 
 //
-// Resets the DSP. Return value indicates whether or not the reset was
-// successful.
+// Starts resetting the DSP. The reset line must then be held for at least 3
+// microseconds before calling dsp_reset_finish(), which can be put to use
+// doing other work.
 //
-int dsp_reset(int base_io_port)
+void dsp_reset_start(int base_io_port)
 {
-    unsigned int tries_left;
-
     outp(base_io_port + DSP_RESET, 1);
-    delay(1);   // TODO: Only need to delay >= 3 microseconds
-    outp(base_io_port + DSP_RESET, 0);
+}
 
-    // Give the DSP some time to initialize
-    delay(1);   // TODO: Needed?
+//
+// Waits for the DSP to signal that it has finished resetting. Return value
+// indicates whether or not it did so in time.
+//
+static int wait_for_reset(int base_io_port)
+{
+    unsigned int tries_left;
 
     // Poll the read port until we get a response indicating a reset, or fail if
     // it takes too long
@@ -50,6 +53,33 @@ int dsp_reset(int base_io_port)
     return 0;
 }
 
+//
+// Finishes resetting the DSP. Unlike dsp_reset(), goes straight on to polling
+// for the DSP to come up, without first giving it time to initialize. Return
+// value indicates whether or not the reset was successful.
+//
+int dsp_reset_finish(int base_io_port)
+{
+    outp(base_io_port + DSP_RESET, 0);
+    return wait_for_reset(base_io_port);
+}
+
+//
+// Resets the DSP. Return value indicates whether or not the reset was
+// successful.
+//
+int dsp_reset(int base_io_port)
+{
+    dsp_reset_start(base_io_port);
+    delay(1);   // TODO: Only need to delay >= 3 microseconds
+    outp(base_io_port + DSP_RESET, 0);
+
+    // Give the DSP some time to initialize
+    delay(1);   // TODO: Needed?
+
+    return wait_for_reset(base_io_port);
+}
+
 //
 // Writes the given value to the DSP. Will block until DSP ready to accept data.
 //
@@ -6,6 +6,8 @@
 #ifndef DSP_H
 #define DSP_H
 
+void dsp_reset_start(int base_io_port);
+int dsp_reset_finish(int base_io_port);
 int dsp_reset(int base_io_port);
 void dsp_write(int base_io_port, int value);
 int dsp_get_version(int base_io_port);
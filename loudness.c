@@ -0,0 +1,552 @@
+//
+// loudness.c
+// Integrated loudness analysis (ITU-R BS.1770 / EBU R128) of WAVE files, with
+// the results cached in a sidecar file next to each analyzed file.
+//
+
+#include "loudness.h"
+#include "wave.h"
+#include "path.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dos.h>
+#include <io.h>
+
+#define PI              3.14159265358979323846
+
+#define READ_SAMPLES    2048    // Samples read from the file at a time
+#define STEPS_PER_BLOCK 4       // 400 ms gating blocks with 75% overlap
+
+// Histogram of gating block loudness, in 0.1 LU bins from the absolute gate
+// of -70 LUFS up to +5 LUFS
+#define HIST_MIN        -70.0
+#define HIST_BINS       750
+
+#define TP_PHASES       4       // True peak oversampling factor
+#define TP_TAPS         12      // Taps in each phase of the true peak filter
+
+//
+// Interpolation filter for true peak measurement, from BS.1770 Annex 2. Each
+// phase gives one of the four oversampled values between input samples.
+//
+static const double tp_coefs[TP_PHASES][TP_TAPS] = {
+    {  0.0017089843750,  0.0109863281250, -0.0196533203125,  0.0332031250000,
+      -0.0594482421875,  0.1373291015625,  0.9721679687500, -0.1022949218750,
+       0.0476074218750, -0.0266113281250,  0.0148925781250, -0.0083007812500 },
+    { -0.0291748046875,  0.0292968750000, -0.0517578125000,  0.0891113281250,
+      -0.1665039062500,  0.4650878906250,  0.7797851562500, -0.2003173828125,
+       0.1015625000000, -0.0582275390625,  0.0330810546875, -0.0189208984375 },
+    { -0.0189208984375,  0.0330810546875, -0.0582275390625,  0.1015625000000,
+      -0.2003173828125,  0.7797851562500,  0.4650878906250, -0.1665039062500,
+       0.0891113281250, -0.0517578125000,  0.0292968750000, -0.0291748046875 },
+    { -0.0083007812500,  0.0148925781250, -0.0266113281250,  0.0476074218750,
+      -0.1022949218750,  0.9721679687500,  0.1373291015625, -0.0594482421875,
+       0.0332031250000, -0.0196533203125,  0.0109863281250,  0.0017089843750 }
+};
+
+//
+// Biquad filter, in transposed direct form II.
+//
+typedef struct {
+    double b0, b1, b2;  // Feed-forward coefficients
+    double a1, a2;      // Feedback coefficients (a0 = 1)
+    double z1, z2;      // State
+} Biquad;
+
+//
+// K-weighting filter for a single channel: a high shelf modelling the acoustic
+// effect of the head, followed by a high-pass.
+//
+typedef struct {
+    Biquad shelf;
+    Biquad highpass;
+} KFilter;
+
+//
+// True peak filter for a single channel. The last TP_TAPS samples are stored
+// twice over, so that they can always be read as one run starting at pos,
+// newest first.
+//
+typedef struct {
+    double history[2 * TP_TAPS];
+    unsigned int pos;
+} PeakFilter;
+
+//
+// Computes the K-weighting filter coefficients for the given sample rate, as
+// given by BS.1770 for 48 kHz and re-derived for other rates.
+//
+static void KFilter_init(KFilter *filter, double rate)
+{
+    double f0, gain, q, k, vh, vb, a0;
+
+    memset(filter, 0, sizeof(*filter));
+
+    // Stage 1: high shelf
+    f0 = 1681.974450955533;
+    gain = 3.999843853973347;
+    q = 0.7071752369554196;
+    k = tan(PI * f0 / rate);
+    vh = pow(10.0, gain / 20.0);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+    filter->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    filter->shelf.b1 = 2.0 * (k * k - vh) / a0;
+    filter->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    filter->shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    filter->shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    // Stage 2: high-pass
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+    filter->highpass.b0 = 1.0;
+    filter->highpass.b1 = -2.0;
+    filter->highpass.b2 = 1.0;
+    filter->highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    filter->highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+//
+// Runs a single sample through a biquad filter.
+//
+static double Biquad_process(Biquad *bq, double x)
+{
+    double y = bq->b0 * x + bq->z1;
+    bq->z1 = bq->b1 * x - bq->a1 * y + bq->z2;
+    bq->z2 = bq->b2 * x - bq->a2 * y;
+    return y;
+}
+
+//
+// Runs a single sample through a true peak filter. Returns the largest
+// magnitude of the oversampled values it gives.
+//
+static double PeakFilter_process(PeakFilter *filter, double x)
+{
+    double *history;
+    double y, peak = 0.0;
+    int phase, i;
+
+    filter->pos = filter->pos == 0 ? TP_TAPS - 1 : filter->pos - 1;
+    filter->history[filter->pos] = x;
+    filter->history[filter->pos + TP_TAPS] = x;
+    history = &filter->history[filter->pos];
+
+    for (phase = 0; phase < TP_PHASES; phase++) {
+        y = 0.0;
+        for (i = 0; i < TP_TAPS; i++)
+            y += tp_coefs[phase][i] * history[i];
+        if (y < 0.0)
+            y = -y;
+        if (y > peak)
+            peak = y;
+    }
+
+    return peak;
+}
+
+//
+// Returns the mean square energy at the center of a histogram bin.
+//
+static double get_bin_energy(int bin)
+{
+    double loudness = HIST_MIN + (bin + 0.5) / 10.0;
+    return pow(10.0, (loudness + 0.691) / 10.0);
+}
+
+//
+// Returns the gated integrated loudness from the histogram of gating block
+// loudness. Returns LOUDNESS_SILENT / 100 if no block passed the absolute gate.
+//
+static double get_integrated_loudness(unsigned long *hist)
+{
+    double sum = 0.0, relative_gate;
+    unsigned long count = 0;
+    int bin, first_bin;
+
+    // Absolute gate (already applied when filling the histogram)
+    for (bin = 0; bin < HIST_BINS; bin++) {
+        sum += hist[bin] * get_bin_energy(bin);
+        count += hist[bin];
+    }
+    if (count == 0)
+        return LOUDNESS_SILENT / 100.0;
+
+    // Relative gate, 10 LU below the absolute-gated loudness
+    relative_gate = -0.691 + 10.0 * log10(sum / count) - 10.0;
+    first_bin = (int) ceil((relative_gate - HIST_MIN) * 10.0 - 0.5);
+    if (first_bin < 0)
+        first_bin = 0;
+
+    sum = 0.0;
+    count = 0;
+    for (bin = first_bin; bin < HIST_BINS; bin++) {
+        sum += hist[bin] * get_bin_energy(bin);
+        count += hist[bin];
+    }
+    if (count == 0)
+        return LOUDNESS_SILENT / 100.0;
+
+    return -0.691 + 10.0 * log10(sum / count);
+}
+
+//
+// Reads the size and modification time of an open file into the info.
+// Return value indicates whether they could be read.
+//
+static int get_file_stamp(FILE *file, LoudnessInfo *info)
+{
+    if (_dos_getftime(fileno(file), &info->date, &info->time) != 0)
+        return 0;
+    info->file_size = filelength(fileno(file));
+    return 1;
+}
+
+//
+// Builds the path of the sidecar file for the given WAVE file, by replacing
+// its extension. Return value indicates failure if the path is too long.
+//
+static int get_sidecar_path(char *dest, const char *path)
+{
+    const char *ext = NULL;
+    const char *p;
+    size_t len;
+
+    // Find the extension of the file name (not of a directory)
+    for (p = path; *p != '\0'; p++) {
+        if (*p == '.')
+            ext = p;
+        else if (path_is_separator(*p))
+            ext = NULL;
+    }
+    len = ext != NULL ? (size_t) (ext - path) : strlen(path);
+
+    if (len + sizeof(LOUDNESS_EXTENSION) > MAX_PATH_LEN)
+        return 0;
+
+    memcpy(dest, path, len);
+    strcpy(dest + len, LOUDNESS_EXTENSION);
+    return 1;
+}
+
+//
+// Measures the integrated loudness and true peak of the audio data in a
+// 16-bit stereo WAVE file, and works out the gain needed to bring it to the
+// target loudness without the true peak exceeding LOUDNESS_MAX_PEAK. Provide
+// buffers for reading samples and for the gating block histogram. Return
+// value indicates failure reading the file, or file isn't of the right format.
+//
+static int measure_loudness(FILE *file, short *samples, unsigned long *hist,
+                            LoudnessInfo *info)
+{
+    WaveFileHeader header;
+    KFilter filters[2];
+    PeakFilter peak_filters[2];
+    unsigned long bytes_left;
+    unsigned long step_frames, frames_in_step = 0;
+    double step_energy = 0.0, steps[STEPS_PER_BLOCK];
+    unsigned int num_steps = 0;
+    unsigned int count, i;
+    int peak = 0;
+    double true_peak = 0.0, x;
+    double loudness, peak_db, gain_db, gain;
+
+    switch (WaveFileHeader_read(&header, file)) {
+    case 1:
+        return 1;
+    case 2:
+        return 2;
+    }
+    if (header.bits_per_sample != 16 || header.sample_rate < 10)
+        return 2;
+
+    KFilter_init(&filters[0], header.sample_rate);
+    KFilter_init(&filters[1], header.sample_rate);
+    memset(peak_filters, 0, sizeof(peak_filters));
+    step_frames = header.sample_rate / 10;  // 100 ms
+
+    if (WaveFileHeader_data_size_known(&header))
+        bytes_left = header.data_size;
+    else
+        bytes_left = WAVE_UNKNOWN_SIZE;
+
+    while (bytes_left > 0) {
+        count = READ_SAMPLES * sizeof(short);
+        if (bytes_left < count)
+            count = (unsigned int) bytes_left;
+
+        count = fread(samples, 1, count, file);
+        if (ferror(file))
+            return 1;
+        if (count == 0)
+            break;
+        if (bytes_left != WAVE_UNKNOWN_SIZE)
+            bytes_left -= count;
+
+        count /= 2 * sizeof(short);     // Number of stereo frames
+        for (i = 0; i < count; i++) {
+            int left = samples[2 * i];
+            int right = samples[2 * i + 1];
+            double y;
+
+            // Track the sample peak, using the magnitude of negative samples
+            // less one so that -32768 doesn't overflow
+            if (left < 0)
+                left = -(left + 1);
+            if (right < 0)
+                right = -(right + 1);
+            if (left > peak)
+                peak = left;
+            if (right > peak)
+                peak = right;
+
+            x = samples[2 * i] / 32768.0;
+            y = PeakFilter_process(&peak_filters[0], x);
+            if (y > true_peak)
+                true_peak = y;
+            y = Biquad_process(&filters[0].shelf, x);
+            y = Biquad_process(&filters[0].highpass, y);
+            step_energy += y * y;
+
+            x = samples[2 * i + 1] / 32768.0;
+            y = PeakFilter_process(&peak_filters[1], x);
+            if (y > true_peak)
+                true_peak = y;
+            y = Biquad_process(&filters[1].shelf, x);
+            y = Biquad_process(&filters[1].highpass, y);
+            step_energy += y * y;
+
+            if (++frames_in_step < step_frames)
+                continue;
+
+            // End of a 100 ms step. Once there are enough steps, measure the
+            // gating block made up of the last four of them.
+            steps[num_steps % STEPS_PER_BLOCK] = step_energy;
+            num_steps++;
+            step_energy = 0.0;
+            frames_in_step = 0;
+
+            if (num_steps >= STEPS_PER_BLOCK) {
+                double block_energy = 0.0;
+                int j;
+
+                for (j = 0; j < STEPS_PER_BLOCK; j++)
+                    block_energy += steps[j];
+                block_energy /= STEPS_PER_BLOCK * (double) step_frames;
+
+                if (block_energy > 0.0) {
+                    double block_loudness =
+                        -0.691 + 10.0 * log10(block_energy);
+                    long bin = (long) floor((block_loudness - HIST_MIN) * 10.0);
+                    if (bin >= 0) {
+                        if (bin >= HIST_BINS)
+                            bin = HIST_BINS - 1;
+                        hist[bin]++;
+                    }
+                }
+            }
+        }
+    }
+
+    // The true peak is never below the sample peak, whatever the filter's
+    // ripple does to it
+    if ((peak + 1) / 32768.0 > true_peak)
+        true_peak = (peak + 1) / 32768.0;
+
+    loudness = get_integrated_loudness(hist);
+    peak_db = peak > 0 ? 20.0 * log10(true_peak) : LOUDNESS_SILENT / 100.0;
+
+    info->loudness = (long) floor(loudness * 100.0 + 0.5);
+    info->peak = (long) floor(peak_db * 100.0 + 0.5);
+
+    // Don't touch silent files, and never let the gain push the peak too high
+    gain = 1.0;
+    if (info->loudness > LOUDNESS_SILENT) {
+        gain_db = (LOUDNESS_TARGET - info->loudness) / 100.0;
+        if (peak_db + gain_db > LOUDNESS_MAX_PEAK / 100.0)
+            gain_db = LOUDNESS_MAX_PEAK / 100.0 - peak_db;
+        gain = pow(10.0, gain_db / 20.0);
+    }
+
+    gain = floor(gain * LOUDNESS_UNITY_GAIN + 0.5);
+    if (gain < 1.0)
+        gain = 1.0;
+    else if (gain > 0xFFFF)
+        gain = 0xFFFF;
+    info->gain = (unsigned short) gain;
+
+    return 0;
+}
+
+//
+// Analyzes the loudness of a 16-bit stereo WAVE file. Return value indicates
+// failure reading the file, or file isn't of the right format.
+//
+int Loudness_analyze(const char *path, LoudnessInfo *info)
+{
+    short *samples;
+    unsigned long *hist;
+    FILE *file;
+    int result;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+        return 1;
+
+    memset(info, 0, sizeof(*info));
+    memcpy(info->magic, "SBLN", 4);
+    info->version = LOUDNESS_VERSION;
+
+    samples = (short *) malloc(READ_SAMPLES * sizeof(short));
+    hist = (unsigned long *) calloc(HIST_BINS, sizeof(unsigned long));
+
+    if (samples == NULL || hist == NULL || get_file_stamp(file, info) == 0)
+        result = 1;
+    else
+        result = measure_loudness(file, samples, hist, info);
+
+    free(samples);
+    free(hist);
+    fclose(file);
+    return result;
+}
+
+//
+// Analyzes the given WAVE file, or each WAVE file in the given directory,
+// saving the results to sidecar files and printing them to stdout. Fills in
+// the number of files analyzed. Return value indicates whether all the files
+// could be analyzed.
+//
+int Loudness_analyze_path(const char *path, unsigned int *num_files)
+{
+    char file_path[MAX_PATH_LEN];
+    struct find_t info;
+    LoudnessInfo loudness_info;
+    int is_dir;
+    int ok = 1;
+
+    *num_files = 0;
+
+    if (path_is_directory(path, &is_dir) == 0)
+        return 0;
+
+    if (is_dir == 0) {
+        if (Loudness_analyze(path, &loudness_info) != 0 ||
+            Loudness_save(path, &loudness_info) == 0)
+            return 0;
+        LoudnessInfo_print(path, &loudness_info);
+        *num_files = 1;
+        return 1;
+    }
+
+    // Directory, so analyze each WAVE file in it
+    if (path_join(file_path, path, "*.WAV") == 0)
+        return 0;
+
+    if (_dos_findfirst(file_path, _A_NORMAL, &info) == 0) {
+        do {
+            if (path_join(file_path, path, info.name) == 0 ||
+                Loudness_analyze(file_path, &loudness_info) != 0 ||
+                Loudness_save(file_path, &loudness_info) == 0) {
+                fprintf(stderr, "%s: failed to analyze\n", info.name);
+                ok = 0;
+                continue;
+            }
+            LoudnessInfo_print(info.name, &loudness_info);
+            (*num_files)++;
+        } while (_dos_findnext(&info) == 0);
+        _dos_findclose(&info);
+    }
+
+    return ok;
+}
+
+//
+// Writes the analysis results for a WAVE file to its sidecar file. Return
+// value indicates whether the write was successful.
+//
+int Loudness_save(const char *path, LoudnessInfo *info)
+{
+    char sidecar_path[MAX_PATH_LEN];
+    FILE *file;
+    int ok;
+
+    if (get_sidecar_path(sidecar_path, path) == 0)
+        return 0;
+
+    file = fopen(sidecar_path, "wb");
+    if (file == NULL)
+        return 0;
+
+    ok = fwrite(info, sizeof(*info), 1, file) == 1;
+    if (fclose(file) != 0)
+        ok = 0;
+
+    return ok;
+}
+
+//
+// Reads the cached analysis results for a WAVE file from its sidecar file.
+// The results are only returned if the (open) WAVE file hasn't changed since
+// it was analyzed. Return value indicates whether up to date results were
+// found.
+//
+int Loudness_load(const char *path, FILE *file, LoudnessInfo *info)
+{
+    char sidecar_path[MAX_PATH_LEN];
+    LoudnessInfo stamp;
+    FILE *sidecar;
+    int ok;
+
+    if (get_sidecar_path(sidecar_path, path) == 0)
+        return 0;
+
+    sidecar = fopen(sidecar_path, "rb");
+    if (sidecar == NULL)
+        return 0;
+    ok = fread(info, sizeof(*info), 1, sidecar) == 1;
+    fclose(sidecar);
+
+    // Sidecars from older versions may hold a gain worked out differently
+    if (ok == 0 || memcmp(info->magic, "SBLN", 4) != 0 ||
+        info->version != LOUDNESS_VERSION)
+        return 0;
+
+    // Make sure the file hasn't changed since it was analyzed
+    if (get_file_stamp(file, &stamp) == 0)
+        return 0;
+    return stamp.date == info->date && stamp.time == info->time &&
+           stamp.file_size == info->file_size;
+}
+
+//
+// Scales 16-bit samples in place by the given 4.12 fixed point gain, clipping
+// any that overflow.
+//
+void Loudness_apply_gain(short *samples, unsigned int num_samples,
+                         unsigned int gain)
+{
+    long value;
+
+    for (; num_samples > 0; num_samples--, samples++) {
+        value = ((long) *samples * (long) gain) >> LOUDNESS_GAIN_SHIFT;
+        if (value > 32767)
+            value = 32767;
+        else if (value < -32768)
+            value = -32768;
+        *samples = (short) value;
+    }
+}
+
+//
+// Prints the analysis results for a WAVE file to stdout.
+//
+void LoudnessInfo_print(const char *name, LoudnessInfo *info)
+{
+    printf("%-12s  %7.2f LUFS  peak %7.2f dBTP  gain %6.2f dB\n", name,
+           info->loudness / 100.0, info->peak / 100.0,
+           20.0 * log10((double) info->gain / LOUDNESS_UNITY_GAIN));
+}
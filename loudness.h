@@ -0,0 +1,43 @@
+//
+// loudness.h
+// Integrated loudness analysis (ITU-R BS.1770 / EBU R128) of WAVE files, with
+// the results cached in a sidecar file next to each analyzed file.
+//
+
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <stdio.h>
+
+#define LOUDNESS_EXTENSION  ".LUF"  // Extension of loudness sidecar files
+#define LOUDNESS_TARGET     -2300L  // Target loudness in 1/100 LUFS (R128)
+#define LOUDNESS_MAX_PEAK   -100L   // Highest allowed true peak in 1/100 dBTP
+#define LOUDNESS_SILENT     -7000L  // Loudness reported for silent files
+#define LOUDNESS_GAIN_SHIFT 12      // Gain is 4.12 fixed point
+#define LOUDNESS_UNITY_GAIN (1U << LOUDNESS_GAIN_SHIFT)
+#define LOUDNESS_VERSION    1       // Bump when sidecar contents change
+
+//
+// Loudness sidecar file contents. Fields are ordered so that the layout has no
+// padding under any structure packing.
+//
+typedef struct {
+    char magic[4];              // Contains the string "SBLN"
+    unsigned long file_size;    // Size of the analyzed file
+    long loudness;              // Integrated loudness in 1/100 LUFS
+    long peak;                  // True peak in 1/100 dBTP
+    unsigned short date;        // DOS modification date of analyzed file
+    unsigned short time;        // DOS modification time of analyzed file
+    unsigned short gain;        // Gain to reach target loudness (4.12)
+    unsigned short version;     // LOUDNESS_VERSION
+} LoudnessInfo;
+
+int Loudness_analyze(const char *path, LoudnessInfo *info);
+int Loudness_analyze_path(const char *path, unsigned int *num_files);
+int Loudness_save(const char *path, LoudnessInfo *info);
+int Loudness_load(const char *path, FILE *file, LoudnessInfo *info);
+void Loudness_apply_gain(short *samples, unsigned int num_samples,
+                         unsigned int gain);
+void LoudnessInfo_print(const char *name, LoudnessInfo *info);
+
+#endif
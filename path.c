@@ -0,0 +1,59 @@
+//
+// path.c
+// Helpers for building and taking apart DOS paths.
+//
+
+#include "path.h"
+#include <string.h>
+#include <dos.h>
+
+//
+// Returns whether the given character ends the directory or drive part of a
+// path.
+//
+int path_is_separator(char c)
+{
+    return c == '\\' || c == '/' || c == ':';
+}
+
+//
+// Finds out whether the given path names a directory. A path ending in a
+// separator (such as a root directory) is taken to be a directory without
+// asking DOS, which can't get the attributes of those. Return value indicates
+// failure if the path doesn't exist.
+//
+int path_is_directory(const char *path, int *is_dir)
+{
+    size_t len = strlen(path);
+    unsigned int attrib;
+
+    if (len > 0 && path_is_separator(path[len - 1])) {
+        *is_dir = 1;
+        return 1;
+    }
+
+    if (_dos_getfileattr(path, &attrib) != 0)
+        return 0;
+
+    *is_dir = (attrib & _A_SUBDIR) != 0;
+    return 1;
+}
+
+//
+// Joins a directory path and a file name. Return value indicates failure if
+// the result would be too long.
+//
+int path_join(char *dest, const char *dir_path, const char *name)
+{
+    size_t len = strlen(dir_path);
+
+    if (len + 1 + strlen(name) + 1 > MAX_PATH_LEN)
+        return 0;
+
+    strcpy(dest, dir_path);
+    if (len > 0 && path_is_separator(dest[len - 1]) == 0)
+        dest[len++] = '\\';
+    strcpy(dest + len, name);
+
+    return 1;
+}
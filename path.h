@@ -0,0 +1,15 @@
+//
+// path.h
+// Helpers for building and taking apart DOS paths.
+//
+
+#ifndef PATH_H
+#define PATH_H
+
+#define MAX_PATH_LEN    80      // Longest path DOS will accept
+
+int path_is_separator(char c);
+int path_is_directory(const char *path, int *is_dir);
+int path_join(char *dest, const char *dir_path, const char *name);
+
+#endif
@@ -0,0 +1,173 @@
+//
+// quality.c
+// Watchdog that lowers the output quality when refills of the DMA buffer fall
+// behind, and the cheaper gain kernel used at the lower quality level.
+//
+
+#include "quality.h"
+#include "loudness.h"
+#include <stdio.h>
+
+//
+// The watchdog steps down a level as soon as a refill finishes with less than
+// 1/SLACK_LOW_DIV of the playing half left, and steps back up a level after
+// QUALITY_UP_REFILLS refills in a row finish with at least 1/SLACK_HIGH_DIV
+// left.
+//
+#define SLACK_LOW_DIV       8
+#define SLACK_HIGH_DIV      2
+#define QUALITY_UP_REFILLS  128
+
+//
+// Initializes the watchdog at full quality. Provide the cheapest level that
+// actually saves work for the file being played; the watchdog never steps
+// below it.
+//
+void QualityWatchdog_init(QualityWatchdog *watchdog, unsigned int half_size,
+                          int lowest_level)
+{
+    watchdog->level = QUALITY_FULL;
+    watchdog->lowest_level = lowest_level;
+    watchdog->half_size = half_size;
+    watchdog->refills = 0;
+    watchdog->good_refills = 0;
+    watchdog->min_slack = half_size;
+    watchdog->underruns = 0;
+    watchdog->num_events = 0;
+}
+
+//
+// Logs a move from the current quality level to the given one, which may be
+// the same if only logging a late refill.
+//
+static void log_event(QualityWatchdog *watchdog, int level, unsigned int slack)
+{
+    QualityEvent *event;
+
+    if (watchdog->num_events < QUALITY_LOG_SIZE) {
+        event = &watchdog->log[watchdog->num_events];
+        event->refill = watchdog->refills;
+        event->from_level = watchdog->level;
+        event->to_level = level;
+        event->slack = slack;
+    }
+    watchdog->num_events++;
+}
+
+//
+// Changes the quality level, logging the transition.
+//
+static void set_level(QualityWatchdog *watchdog, int level, unsigned int slack)
+{
+    log_event(watchdog, level, slack);
+    watchdog->level = level;
+    watchdog->good_refills = 0;
+}
+
+//
+// Updates the watchdog after a refill, given the number of bytes of the other
+// half of the DMA buffer that were still left to play when the refill
+// finished (zero if it finished too late). Returns the quality level to use
+// for the next refill.
+//
+int QualityWatchdog_update(QualityWatchdog *watchdog, unsigned int slack)
+{
+    watchdog->refills++;
+    if (slack < watchdog->min_slack)
+        watchdog->min_slack = slack;
+    if (slack == 0)
+        watchdog->underruns++;
+
+    if (slack < watchdog->half_size / SLACK_LOW_DIV) {
+        // Close to (or past) an underrun, so do less work per refill. A late
+        // refill is logged even when there's no cheaper level to go to, as
+        // the stale half it left playing is heard.
+        if (watchdog->level < watchdog->lowest_level)
+            set_level(watchdog, watchdog->level + 1, slack);
+        else if (slack == 0)
+            log_event(watchdog, watchdog->level, slack);
+        watchdog->good_refills = 0;
+    } else if (slack >= watchdog->half_size / SLACK_HIGH_DIV) {
+        // Plenty of headroom. Once it has lasted a while, try doing more.
+        if (watchdog->level > QUALITY_FULL &&
+            ++watchdog->good_refills >= QUALITY_UP_REFILLS)
+            set_level(watchdog, watchdog->level - 1, slack);
+    } else {
+        watchdog->good_refills = 0;
+    }
+
+    return watchdog->level;
+}
+
+//
+// Prints the watchdog statistics and logged transitions to stdout.
+//
+void QualityWatchdog_print(QualityWatchdog *watchdog)
+{
+    unsigned int i;
+    QualityEvent *event;
+
+    printf("Refills:            %lu\n", watchdog->refills);
+    printf("Late refills:       %lu\n", watchdog->underruns);
+    printf("Min slack (bytes):  %u\n", watchdog->min_slack);
+    printf("Final level:        %d\n", watchdog->level);
+
+    for (i = 0; i < watchdog->num_events && i < QUALITY_LOG_SIZE; i++) {
+        event = &watchdog->log[i];
+        printf("Refill %lu: ", event->refill);
+        if (event->from_level != event->to_level)
+            printf("level %d -> %d", event->from_level, event->to_level);
+        else
+            printf("level %d", event->to_level);
+        printf(" (slack %u/%u%s)\n", event->slack, watchdog->half_size,
+               event->slack == 0 ? ", late" : "");
+    }
+    if (watchdog->num_events > QUALITY_LOG_SIZE)
+        printf("(%u more events not logged)\n",
+               watchdog->num_events - QUALITY_LOG_SIZE);
+}
+
+//
+// Returns the largest power of two no greater than the given 4.12 fixed point
+// gain, as a shift to apply to samples (negative shifts to the right).
+// Rounding down means the cheaper gain can lose precision, but never pushes
+// the peak past the ceiling the gain was worked out for.
+//
+int quality_get_gain_shift(unsigned int gain)
+{
+    int shift = -LOUDNESS_GAIN_SHIFT;
+    unsigned long power = 1;
+
+    while (shift < 15 - LOUDNESS_GAIN_SHIFT && power * 2 <= gain) {
+        power <<= 1;
+        shift++;
+    }
+
+    return shift;
+}
+
+//
+// Scales 16-bit samples in place by a power of two, clipping any that
+// overflow. A cheap stand-in for Loudness_apply_gain().
+//
+void quality_apply_shift_gain(short *samples, unsigned int num_samples,
+                              int shift)
+{
+    long value;
+
+    if (shift == 0)
+        return;
+
+    for (; num_samples > 0; num_samples--, samples++) {
+        if (shift < 0) {
+            *samples >>= -shift;
+        } else {
+            value = (long) *samples << shift;
+            if (value > 32767)
+                value = 32767;
+            else if (value < -32768)
+                value = -32768;
+            *samples = (short) value;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+//
+// quality.h
+// Watchdog that lowers the output quality when refills of the DMA buffer fall
+// behind, and the cheaper gain kernel used at the lower quality level.
+//
+
+#ifndef QUALITY_H
+#define QUALITY_H
+
+//
+// Quality levels, from best to cheapest. Only the gain work can be shed:
+// reading the file costs the same per second of audio whatever format the
+// card plays, so folding to mono or halving the rate would only add a
+// conversion pass on top of it, making refills slower rather than faster.
+//
+#define QUALITY_FULL        0   // As in the file
+#define QUALITY_CHEAP_GAIN  1   // Normalization gain rounded down to a shift
+
+#define QUALITY_LOG_SIZE    32  // Number of events kept in the log
+
+//
+// A logged change of quality level or late refill. For a late refill that
+// didn't change the level, the old and new levels are the same.
+//
+typedef struct {
+    unsigned long refill;       // Refill the event happened after
+    int from_level;             // Old quality level
+    int to_level;               // New quality level
+    unsigned int slack;         // Bytes left to play when the refill finished
+} QualityEvent;
+
+//
+// Structure holding the state of the watchdog.
+//
+typedef struct {
+    int level;                  // Quality level for the next refill
+    int lowest_level;           // Cheapest level worth stepping down to
+    unsigned int half_size;     // Size of half the DMA buffer in bytes
+    unsigned long refills;      // Number of refills seen
+    unsigned int good_refills;  // Consecutive refills with plenty of slack
+    unsigned int min_slack;     // Smallest slack seen (bytes)
+    unsigned long underruns;    // Refills that finished too late
+    QualityEvent log[QUALITY_LOG_SIZE]; // Events, oldest first
+    unsigned int num_events;    // Number of events (may exceed log size)
+} QualityWatchdog;
+
+void QualityWatchdog_init(QualityWatchdog *watchdog, unsigned int half_size,
+                          int lowest_level);
+int QualityWatchdog_update(QualityWatchdog *watchdog, unsigned int slack);
+void QualityWatchdog_print(QualityWatchdog *watchdog);
+
+int quality_get_gain_shift(unsigned int gain);
+void quality_apply_shift_gain(short *samples, unsigned int num_samples,
+                              int shift);
+
+#endif
@@ -1,17 +1,56 @@
 //
 // sbtest.c
 // Sound Blaster test program. Plays a 16-bit uncompressed PCM WAVE file given
-// as a command line argument. Only supports DSP versions 4.xx for now.
+// as a command line argument, or from standard input if the argument is "-".
+// Only supports DSP versions 4.xx for now.
+//
+// If refills of the DMA buffer start falling behind, the loudness
+// normalization gain is rounded down to a power of two and applied with a
+// cheaper kernel until there is headroom again (see quality.c).
+//
+// Options:
+//   -p  Pipeline mode. File reading runs in the main loop and feeds a ring of
+//       blocks, while the DMA buffer is refilled from the ring by the ISR.
+//   -i  Index mode. Instead of playing, writes an index of the WAVE files in
+//       the given directory tree. Headers of indexed files that haven't
+//       changed since are then taken from the index instead of being parsed.
+//   -l  Loudness mode. Instead of playing, measures the loudness of the given
+//       file or of each file in the given directory, and saves the gain that
+//       normalizes it in a sidecar file. The gain is applied when playing.
+//   -b  Benchmark mode. Times the per-block processing kernels, for comparing
+//       the real-mode and protected-mode builds.
+//   -f  Fast start. Overlaps the DSP reset with opening the file, and starts
+//       playing as soon as a small first period has been read, reading the
+//       rest of the first half of the DMA buffer while it plays. In pipeline
+//       mode only the overlapped reset applies.
+//   -q  Quiet. Doesn't print the card, file and DMA buffer info before
+//       playing.
+//   -r  Render mode. Instead of playing, runs the same refill path as fast as
+//       it will go, writing the bytes that would have been sent to the card
+//       to the given WAVE file (or nowhere, if it's NUL), and reports the
+//       speed achieved as a multiple of real time. The card isn't touched.
+//
+// The time taken by each startup phase is reported after playback.
 //
 
 #include "sbinfo.h"
 #include "dsp.h"
 #include "wave.h"
 #include "dmabuf.h"
+#include "blkring.h"
+#include "wavindex.h"
+#include "loudness.h"
+#include "bench.h"
+#include "quality.h"
+#include "timer.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <dos.h>
+#include <bios.h>
 #include <conio.h>
+#include <io.h>
+#include <fcntl.h>
 
 #define DMA5_ADDR       0xC4
 #define DMA5_COUNT      0xC6
@@ -31,8 +70,16 @@
 #define DMA_AUTO_INIT       1
 
 #define DSP_HALT_SINGLE_CYCLE_DMA   0xD0
+#define DSP_EXIT_AUTO_INIT_16       0xD9
 
 #define DMA_BUFFER_SIZE 8192    // Size of DMA buffer in bytes
+#define FIRST_PERIOD    512     // Bytes read before starting in fast start
+#define MAX_PHASES      16      // Number of startup phases that can be timed
+#ifdef __386__
+#define PIPELINE_BLOCKS 64      // Blocks live in extended memory, so use lots
+#else
+#define PIPELINE_BLOCKS 8       // Number of blocks in the pipeline block ring
+#endif
 
 #define PIC_END_OF_INT  0x20
 #define PIC_MASK        0x21
@@ -49,6 +96,33 @@ static DMABuffer dma_buf;           // DMA buffer for transferring audio data
 static WaveFileHeader wave_header;  // WAVE file header
 static int volatile playing_half;   // Half of DMA buffer currently being played
 static FILE *file;                  // The input file
+static unsigned long bytes_left;    // Audio data bytes left to read
+static unsigned int gain = LOUDNESS_UNITY_GAIN; // Gain applied to audio data
+static int dma_count_port;          // Count register of the 16-bit DMA channel
+
+static QualityWatchdog watchdog;    // Lowers quality if refills fall behind
+
+// Startup timing
+static const char *phase_names[MAX_PHASES]; // Name of each phase
+static unsigned long phase_ends[MAX_PHASES];// Time at which each phase ended
+static int num_phases;                      // Number of phases timed
+static unsigned long start_time;            // Time at which the program started
+static unsigned int late_periods;           // Fast start reads that were late
+
+// Hardware state to put back on exit
+static int reset_pending_port = -1; // Base I/O port of DSP held in reset
+static int timer_running;           // Has the PIT been switched to timing?
+
+// Pipeline mode state
+static BlockRing block_ring;            // Blocks queued between stages
+static unsigned char *reader_block;     // Reader stage's working block
+static int volatile pipeline_active;    // Is the ISR running the output stage?
+static int volatile reader_done;        // Has the reader stage hit the end?
+static int volatile stop_requested;     // Did the user stop playback early?
+static int volatile end_half = -1;      // Half holding the last audio data
+static unsigned int volatile end_count; // Bytes of audio data in that half
+
+static void pipeline_output_stage(void);
 
 //
 // ISR invoked each time the DSP finishes playing half the DMA buffer.
@@ -65,6 +139,9 @@ void __interrupt dma_output_isr(void)
 
     playing_half ^= 1;  // Switch half of DMA buffer currently being played
 
+    if (pipeline_active)
+        pipeline_output_stage();
+
     outp(PIC_MODE, PIC_END_OF_INT);     // End of interrupt
 }
 
@@ -119,6 +196,8 @@ int program_dma(void)
     outp(dma_addr, offset & 0xFF);
     outp(dma_addr, offset >> 8);
 
+    dma_count_port = dma_count;     // Needed to read the playing position
+
     outp(DMA16_MASK_REG, sb_info.dma16_channel - 4);
 
     // Note: not strictly necessary on DSP versions 4.xx.
@@ -157,34 +236,184 @@ void play(int dma_mode, unsigned long count)
 }
 
 //
-// Repeatedly refills the DMA buffer and waits for the read sample to be played.
-// Stops when the entire audio file has been played.
+// Records the end of a startup phase.
+//
+void end_phase(const char *name)
+{
+    if (num_phases < MAX_PHASES) {
+        phase_names[num_phases] = name;
+        phase_ends[num_phases] = timer_read();
+        num_phases++;
+    }
+}
+
+//
+// Prints how long each startup phase took to stdout.
+//
+void print_phases(void)
+{
+    unsigned long last = start_time;
+    int i;
+
+    for (i = 0; i < num_phases; i++) {
+        printf("%-20s%8.2f ms\n", phase_names[i],
+               timer_to_ms(phase_ends[i] - last));
+        last = phase_ends[i];
+    }
+    if (num_phases > 0)
+        printf("%-20s%8.2f ms\n", "Total:",
+               timer_to_ms(phase_ends[num_phases - 1] - start_time));
+    if (late_periods > 0)
+        printf("Late first periods: %u\n", late_periods);
+}
+
+//
+// Returns whether a key has been pressed to stop playback, eating the typed
+// key. When playing from standard input, kbhit() and getch() would read the
+// audio data instead of the keyboard, so the BIOS is asked instead.
+//
+int stop_key_pressed(void)
+{
+    if (file == stdin) {
+        if (_bios_keybrd(_KEYBRD_READY) == 0)
+            return 0;
+        _bios_keybrd(_KEYBRD_READ);
+        return 1;
+    }
+
+    if (kbhit() == 0)
+        return 0;
+    getch();
+    return 1;
+}
+
+//
+// Reads up to size bytes of audio data, reading no further than the end of
+// the audio data. Returns the number of bytes read.
+//
+unsigned int read_audio_data(unsigned char *dest, unsigned int size)
+{
+    unsigned int count;
+
+    if (bytes_left < size)
+        size = (unsigned int) bytes_left;
+
+    count = fread(dest, 1, size, file);
+    if (ferror(file)) {
+        fprintf(stderr, "Couldn't read audio data\n");
+        exit(1);
+    }
+
+    // If the data size isn't known, just play until the end of the file.
+    if (WaveFileHeader_data_size_known(&wave_header))
+        bytes_left -= count;
+
+    return count;
+}
+
 //
-void play_and_refill_buffer(unsigned long bytes_left)
+// Returns the offset into the DMA buffer that the DMA controller is currently
+// transferring from.
+//
+unsigned int get_dma_offset(void)
 {
+    unsigned int first, second;
+
+    // The count can tick over between reading its low and high bytes, so read
+    // it until two reads agree on the high byte
     do {
-        unsigned long count;
-        int last_fill_half = dma_buf.fill_half ^ 1;
+        outp(DMA16_FF_REG, 0);
+        first = inp(dma_count_port);
+        first |= inp(dma_count_port) << 8;
+        outp(DMA16_FF_REG, 0);
+        second = inp(dma_count_port);
+        second |= inp(dma_count_port) << 8;
+    } while ((first ^ second) & 0xFF00);
+
+    // The count register holds the number of words left, less one
+    return (dma_buf.size - ((second + 1) & 0xFFFF) * 2) % dma_buf.size;
+}
 
-        // Fill the next half of the DMA buffer with audio data while we're
-        // waiting for the current sample to finish playing.
-        if (DMABuffer_fill_half_buffer(&dma_buf, file, &count) == 1) {
-            fprintf(stderr, "Couldn't fill DMA buffer\n");
-            exit(1);
-        }
+//
+// Returns the number of bytes of the given half of the DMA buffer left to
+// play, or zero if it's no longer playing.
+//
+unsigned int get_slack(int half)
+{
+    unsigned int half_size = dma_buf.size / 2;
+    unsigned int start = half * half_size;
+    unsigned int offset;
+
+    if (playing_half != half)
+        return 0;
+
+    offset = get_dma_offset();
+    if (offset < start || offset >= start + half_size)
+        return 0;   // Interrupt for the end of the half is pending
+
+    return start + half_size - offset;
+}
+
+//
+// Applies the loudness normalization gain (if any) to count bytes of audio
+// data, using the gain kernel for the given quality level.
+//
+void apply_gain(unsigned char *buffer, unsigned int count, int level)
+{
+    if (gain == LOUDNESS_UNITY_GAIN)
+        return;
+
+    if (level == QUALITY_FULL)
+        Loudness_apply_gain((short *) buffer, count / 2, gain);
+    else
+        quality_apply_shift_gain((short *) buffer, count / 2,
+                                 quality_get_gain_shift(gain));
+}
+
+//
+// Fills the next half of the DMA buffer at the watchdog's current quality
+// level, reading no further than the end of the audio data. Returns the number
+// of bytes written.
+//
+unsigned long fill_half_buffer(void)
+{
+    unsigned long count;
+    unsigned char *buffer;
+
+    buffer = DMABuffer_get_buffer_ptr(&dma_buf);
+    if (dma_buf.fill_half == 1)
+        buffer += dma_buf.size / 2;     // Point to upper half
+
+    if (DMABuffer_fill_half_buffer(&dma_buf, file, bytes_left, &count) == 1) {
+        fprintf(stderr, "Couldn't fill DMA buffer\n");
+        exit(1);
+    }
+
+    // If the data size isn't known, just play until the end of the file.
+    if (WaveFileHeader_data_size_known(&wave_header))
         bytes_left -= count;
 
-        // Wait until we're done playing the last half of the DMA buffer that
-        // was filled.
-        while (playing_half == last_fill_half)
-            ;
+    apply_gain(buffer, (unsigned int) count, watchdog.level);
 
-        if (count < dma_buf.size / 2 || kbhit()) {
-            // If user terminated playback by pressing the keyboard, eat the
-            // typed key.
-            if (kbhit())
-                getch();
+    return count;
+}
 
+//
+// Repeatedly refills the DMA buffer and waits for the read sample to be played.
+// Stops when the entire audio file has been played. Provide count giving the
+// number of bytes in the half of the DMA buffer that was filled last.
+//
+void play_and_refill_buffer(unsigned long count)
+{
+    for (;;) {
+        int last_fill_half = dma_buf.fill_half ^ 1;
+
+        // Wait until we're done playing the half of the DMA buffer before the
+        // one that was filled last.
+        while (playing_half != last_fill_half)
+            ;
+
+        if (count < dma_buf.size / 2 || stop_key_pressed()) {
             // Can play the remaining audio data in a single DMA cycle, so
             // switch to single-cycle DMA mode (terminates auto-initialize DMA
             // mode).
@@ -194,7 +423,409 @@ void play_and_refill_buffer(unsigned long bytes_left)
 
             break;  // Done playing
         }
-    } while (feof(file) == 0);
+
+        // Refill the half of the DMA buffer that just finished playing while
+        // we're waiting for the other half to finish, then see how close we
+        // came to missing the deadline.
+        count = fill_half_buffer();
+        QualityWatchdog_update(&watchdog, get_slack(last_fill_half));
+    }
+}
+
+//
+// Plays the audio data, refilling the DMA buffer from the file in the main
+// loop.
+//
+void play_buffered(void)
+{
+    unsigned long count;
+
+    count = fill_half_buffer();
+    end_phase("Fill first half");
+
+    if (count < dma_buf.size / 2) {
+        // Can play the audio sample in a single DMA cycle
+        play(DMA_SINGLE_CYCLE, count);
+        end_phase("Start playback");
+        while (playing_half == 0)
+            ;
+    } else {
+        // Pre-buffer the other half as well, so that playback only starts once
+        // the whole DMA buffer holds audio data. Streams that are slow to get
+        // going then can't cause the first refill to fall behind.
+        count = fill_half_buffer();
+        end_phase("Fill second half");
+
+        // Need multiple DMA cycles to play the audio sample
+        play(DMA_AUTO_INIT, dma_buf.size / 2);
+        end_phase("Start playback");
+        play_and_refill_buffer(count);
+    }
+}
+
+//
+// Plays the audio data, starting as soon as the first FIRST_PERIOD bytes have
+// been read. The rest of the first half of the DMA buffer is read while it
+// plays, in periods that double in size, and from then on playback carries on
+// as in play_buffered().
+//
+void play_fast_start(void)
+{
+    unsigned int half_size = dma_buf.size / 2;
+    unsigned char *buffer = DMABuffer_get_buffer_ptr(&dma_buf);
+    unsigned int filled, period, count;
+
+    count = read_audio_data(buffer, FIRST_PERIOD);
+    apply_gain(buffer, count, QUALITY_FULL);
+    end_phase("Fill first period");
+
+    if (count < FIRST_PERIOD) {
+        // Can play the audio sample in a single DMA cycle
+        play(DMA_SINGLE_CYCLE, count);
+        end_phase("Start playback");
+        while (playing_half == 0)
+            ;
+        return;
+    }
+
+    // Clear the rest of the DMA buffer, so that if a period is late, silence
+    // is played instead of whatever the memory held before
+    memset(buffer + count, 0, dma_buf.size - count);
+
+    play(DMA_AUTO_INIT, half_size);
+    end_phase("Start playback");
+
+    // Read the rest of the first half while it plays, growing the period each
+    // time. Each period should be in place before the DMA controller gets to
+    // it.
+    filled = count;
+    period = FIRST_PERIOD;
+    while (filled < half_size) {
+        if (period > half_size - filled)
+            period = half_size - filled;
+
+        count = read_audio_data(buffer + filled, period);
+        apply_gain(buffer + filled, count, QUALITY_FULL);
+        if (playing_half != 0 || get_dma_offset() > filled)
+            late_periods++;
+
+        filled += count;
+        if (count < period)
+            break;  // End of the audio data
+        period *= 2;
+    }
+
+    if (filled < half_size) {
+        // The audio data ended in the first half, the rest of which was
+        // cleared to silence, so stop playing at the end of it
+        dsp_write(sb_info.base_io_port, DSP_EXIT_AUTO_INIT_16);
+        while (playing_half == 0)
+            ;
+        return;
+    }
+
+    // Fill the second half before the first finishes, then carry on as usual
+    dma_buf.fill_half = 1;
+    play_and_refill_buffer(fill_half_buffer());
+}
+
+//
+// Output stage of the pipeline, run from the ISR each time half of the DMA
+// buffer finishes playing. Refills that half from the block ring, so output
+// deadlines are met however long the reader stage is stuck in file I/O. Note
+// that the ISR may have interrupted DOS, so this must not pass pointers to
+// local variables around (SS may not equal DS).
+//
+static void pipeline_output_stage(void)
+{
+    unsigned int half_size = dma_buf.size / 2;
+    unsigned char *buffer;
+    unsigned int count;
+
+    if (end_half >= 0)
+        return;     // Last audio data already queued
+
+    // Point to the half that just finished playing
+    buffer = DMABuffer_get_buffer_ptr(&dma_buf);
+    if (playing_half == 0)
+        buffer += half_size;
+
+    count = 0;
+    if (stop_requested == 0)
+        count = BlockRing_read(&block_ring, buffer);
+
+    if (count == 0) {
+        if (reader_done || stop_requested) {
+            // Nothing more to play, so the half now playing is the last one
+            end_count = half_size;
+            end_half = playing_half;
+        } else {
+            // Reader fell behind, so play silence rather than stale data
+            memset(buffer, 0, half_size);
+            block_ring.consumer_stalls++;
+        }
+    } else if (count < half_size) {
+        // Final partial block
+        memset(buffer + count, 0, half_size - count);
+        end_count = count;
+        end_half = playing_half ^ 1;
+    }
+}
+
+//
+// Reader stage of the pipeline. Reads the next block of audio data into the
+// block ring unless the ring is full or all the data has been read. Return
+// value indicates whether a block was read.
+//
+int pipeline_reader_stage(void)
+{
+    unsigned int size = block_ring.block_size;
+    unsigned int count;
+
+    if (reader_done || BlockRing_is_full(&block_ring))
+        return 0;
+
+    count = read_audio_data(reader_block, size);
+
+    apply_gain(reader_block, count, QUALITY_FULL);
+
+    if (count > 0)
+        BlockRing_write(&block_ring, reader_block, count);
+
+    // Flag the end only after the last block has been published
+    if (count < block_ring.block_size)
+        reader_done = 1;
+
+    return 1;
+}
+
+//
+// Plays the audio data in pipeline mode. The main loop runs the reader stage,
+// keeping the block ring topped up, while the ISR runs the output stage.
+//
+void play_pipelined(void)
+{
+    unsigned int half_size = dma_buf.size / 2;
+    unsigned char *buffer = DMABuffer_get_buffer_ptr(&dma_buf);
+    unsigned int count;
+    int stalled = 0;
+
+    // Fill the block ring and both halves of the DMA buffer before starting
+    while (pipeline_reader_stage())
+        ;
+    end_phase("Fill block ring");
+
+    count = BlockRing_read(&block_ring, buffer);
+    if (count < half_size) {
+        // Can play the audio sample in a single DMA cycle
+        play(DMA_SINGLE_CYCLE, count);
+        end_phase("Start playback");
+        while (playing_half == 0)
+            ;
+        return;
+    }
+
+    count = BlockRing_read(&block_ring, buffer + half_size);
+    if (count == 0) {
+        end_count = half_size;
+        end_half = 0;
+    } else if (count < half_size) {
+        memset(buffer + half_size + count, 0, half_size - count);
+        end_count = count;
+        end_half = 1;
+    }
+
+    pipeline_active = 1;
+    play(DMA_AUTO_INIT, half_size);
+    end_phase("Start playback");
+
+    // Keep reading until the output stage has queued the last audio data
+    while (end_half < 0) {
+        if (stop_key_pressed())
+            stop_requested = 1;
+
+        if (reader_done == 0 && BlockRing_is_full(&block_ring)) {
+            // Count each time the reader has to wait for the output stage
+            if (stalled == 0)
+                block_ring.producer_stalls++;
+            stalled = 1;
+            continue;
+        }
+
+        stalled = 0;
+        pipeline_reader_stage();
+    }
+
+    // Wait for the last half to start playing, then switch to single-cycle DMA
+    // mode to play just the audio data in it
+    while (playing_half != end_half)
+        ;
+    play(DMA_SINGLE_CYCLE, end_count);
+    while (playing_half == end_half)    // Finish playing sample
+        ;
+
+    pipeline_active = 0;
+}
+
+//
+// Puts back any hardware state that was left changed, so that exiting early
+// (including on an error) doesn't leave the DSP held in reset or the PIT in
+// the wrong mode. Registered with atexit().
+//
+void cleanup_on_exit(void)
+{
+    if (reset_pending_port >= 0) {
+        dsp_reset_finish(reset_pending_port);
+        reset_pending_port = -1;
+    }
+
+    if (timer_running) {
+        timer_done();
+        timer_running = 0;
+    }
+}
+
+//
+// Prints the command line usage and exits.
+//
+void usage(void)
+{
+    fprintf(stderr, "Usage: sbtest [-p] [-f] [-q] <wave file | ->\n");
+    fprintf(stderr, "       sbtest -i <directory>\n");
+    fprintf(stderr, "       sbtest -l <wave file | directory>\n");
+    fprintf(stderr, "       sbtest -b\n");
+    fprintf(stderr, "       sbtest -r <output wave file | NUL> "
+                    "<wave file | ->\n");
+    exit(1);
+}
+
+//
+// Runs the refill path as fast as it will go instead of playing, writing each
+// half of the DMA buffer (as much of it as would have been played) to the
+// given output file, which may be NULL to discard it. The output is written
+// as a WAVE file in the format the card would have been programmed for.
+// Reports the speed achieved as a multiple of real time.
+//
+void render(FILE *out)
+{
+    WaveFileHeader out_header;
+    unsigned int half_size = dma_buf.size / 2;
+    unsigned char *buffer;
+    unsigned long count, total = 0;
+    unsigned long start, elapsed;
+    double audio_seconds, render_seconds;
+    int half;
+
+    // The card is always programmed for 16-bit stereo
+    WaveFileHeader_init_pcm(&out_header, 2, wave_header.sample_rate, 16, 0);
+    if (out != NULL && WaveFileHeader_write(&out_header, out) == 0) {
+        fprintf(stderr, "Couldn't write output file\n");
+        exit(1);
+    }
+
+    start = timer_read();
+    do {
+        half = dma_buf.fill_half;
+        count = fill_half_buffer();
+
+        buffer = DMABuffer_get_buffer_ptr(&dma_buf);
+        if (half == 1)
+            buffer += half_size;
+
+        if (out != NULL && fwrite(buffer, 1, count, out) != count) {
+            fprintf(stderr, "Couldn't write output file\n");
+            exit(1);
+        }
+        total += count;
+    } while (count == half_size);
+    elapsed = timer_read() - start;
+
+    if (out != NULL) {
+        // Go back and fill in the sizes
+        WaveFileHeader_init_pcm(&out_header, 2, wave_header.sample_rate, 16,
+                                total);
+        if (fseek(out, 0, SEEK_SET) != 0 ||
+            WaveFileHeader_write(&out_header, out) == 0) {
+            fprintf(stderr, "Couldn't write output file\n");
+            exit(1);
+        }
+    }
+
+    audio_seconds = (double) total / out_header.byte_rate;
+    render_seconds = timer_to_ms(elapsed) / 1000.0;
+    printf("Rendered bytes:     %lu\n", total);
+    printf("Audio time:         %.2f s\n", audio_seconds);
+    printf("Render time:        %.2f s\n", render_seconds);
+    if (render_seconds > 0.0)
+        printf("Speed:              %.1fx real time\n",
+               audio_seconds / render_seconds);
+}
+
+//
+// Opens the input file and reads the WAVE file header, taking it from the
+// index if possible. Also picks up the loudness normalization gain.
+//
+void open_input(const char *path, LoudnessInfo *loudness_info)
+{
+    WaveIndexEntry index_entry;
+
+    if (strcmp(path, "-") == 0) {
+        // Stream from standard input (e.g. piped from a decoder). The header
+        // is parsed without seeking, so this works on non-seekable input.
+        file = stdin;
+        setmode(fileno(stdin), O_BINARY);
+    } else {
+        file = fopen(path, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open given file\n");
+            exit(1);
+        }
+    }
+    end_phase("Open file");
+
+    if (file != stdin && WaveIndex_lookup(path, file, &index_entry)) {
+        // File unchanged since it was indexed, so skip parsing the header
+        if (index_entry.valid == 0) {
+            fprintf(stderr, "Given file not of correct format\n");
+            exit(1);
+        }
+        WaveIndexEntry_to_header(&index_entry, &wave_header);
+        if (fseek(file, wave_header.data_offset, SEEK_SET) != 0) {
+            fprintf(stderr, "Failed to read file header\n");
+            exit(1);
+        }
+    } else {
+        switch (WaveFileHeader_read(&wave_header, file)) {
+        case 1:
+            fprintf(stderr, "Failed to read file header\n");
+            exit(1);
+        case 2:
+            fprintf(stderr, "Given file not of correct format\n");
+            exit(1);
+        }
+    }
+
+    // Use the loudness normalization gain, if the file has been analyzed
+    if (file != stdin && Loudness_load(path, file, loudness_info))
+        gain = loudness_info->gain;
+
+    if (WaveFileHeader_data_size_known(&wave_header))
+        bytes_left = wave_header.data_size;
+    else
+        bytes_left = WAVE_UNKNOWN_SIZE;
+    end_phase("Read header");
+}
+
+//
+// Fills in the Sound Blaster card info from the BLASTER environment variable.
+//
+void init_sb_info(void)
+{
+    if (SBInfo_init(&sb_info) == 0) {
+        fprintf(stderr, "Failed to get necessary Sound Blaster card info\n");
+        exit(1);
+    }
+    end_phase("Parse BLASTER");
 }
 
 void set_mixer(void)
@@ -211,50 +842,155 @@ void set_mixer(void)
 
 int main(int argc, char *argv[])
 {
-    void __interrupt (*old_isr)(void);
+    void (__interrupt __far *old_isr)(void);
     int old_pic_mask, irq_mask;
-    unsigned long bytes_left;
-    unsigned long count;
+    int pipeline = 0;
+    int build_index = 0;
+    int analyze = 0;
+    int benchmark = 0;
+    int fast_start = 0;
+    int quiet = 0;
+    int reset_ok;
+    const char *render_path = NULL;
+    FILE *render_file = NULL;
+    LoudnessInfo loudness_info;
+    unsigned int num_files, num_valid;
+    const char *path;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        switch (argv[i][1]) {
+        case 'p':
+        case 'P':
+            pipeline = 1;
+            break;
+        case 'i':
+        case 'I':
+            build_index = 1;
+            break;
+        case 'l':
+        case 'L':
+            analyze = 1;
+            break;
+        case 'b':
+        case 'B':
+            benchmark = 1;
+            break;
+        case 'f':
+        case 'F':
+            fast_start = 1;
+            break;
+        case 'q':
+        case 'Q':
+            quiet = 1;
+            break;
+        case 'r':
+        case 'R':
+            if (i + 1 >= argc)
+                usage();
+            render_path = argv[++i];
+            break;
+        default:
+            usage();
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: sbtest <wave file>\n");
-        exit(1);
+    if (benchmark) {
+        if (i != argc)
+            usage();
+        bench_run(DMA_BUFFER_SIZE / 2);
+        return 0;
     }
 
-    //
-    // Read the WAVE file header.
-    //
+    if (i != argc - 1)
+        usage();
+    path = argv[i];
 
-    file = fopen(argv[1], "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open given file\n");
-        exit(1);
+    if (build_index) {
+        if (WaveIndex_build(path, &num_files, &num_valid) == 0) {
+            fprintf(stderr, "Failed to write index\n");
+            exit(1);
+        }
+        printf("Indexed %u files (%u playable)\n", num_files, num_valid);
+        return 0;
     }
 
-    switch (WaveFileHeader_read(&wave_header, file)) {
-    case 1:
-        fprintf(stderr, "Failed to read file header\n");
-        exit(1);
-    case 2:
-        fprintf(stderr, "Given file not of correct format\n");
-        exit(1);
+    if (analyze) {
+        if (Loudness_analyze_path(path, &num_files) == 0) {
+            fprintf(stderr, "Failed to analyze loudness\n");
+            exit(1);
+        }
+        printf("Analyzed %u files\n", num_files);
+        return 0;
+    }
+
+    atexit(cleanup_on_exit);
+    timer_init();
+    timer_running = 1;
+    start_time = timer_read();
+
+    if (render_path != NULL) {
+        //
+        // Render instead of playing. Only the buffers are needed, not the
+        // card.
+        //
+
+        open_input(path, &loudness_info);
+
+        if (stricmp(render_path, "NUL") != 0) {
+            render_file = fopen(render_path, "wb");
+            if (render_file == NULL) {
+                fprintf(stderr, "Failed to open output file\n");
+                exit(1);
+            }
+        }
+
+        if (DMABuffer_init(&dma_buf, DMA_BUFFER_SIZE) == 0) {
+            fprintf(stderr, "Failed to allocate DMA buffer\n");
+            exit(1);
+        }
+
+        QualityWatchdog_init(&watchdog, dma_buf.size / 2, QUALITY_FULL);
+
+        render(render_file);
+
+        if (render_file != NULL && fclose(render_file) != 0) {
+            fprintf(stderr, "Couldn't write output file\n");
+            exit(1);
+        }
+        DMABuffer_free(&dma_buf);
+        if (file != stdin)
+            fclose(file);
+        return 0;
     }
 
     //
-    // Initialize the Sound Blaster card and read the DSP version.
+    // Read the WAVE file header, and initialize the Sound Blaster card and
+    // read the DSP version. For a fast start, the file is opened while the DSP
+    // reset line is held, instead of sleeping.
     //
 
-    if (SBInfo_init(&sb_info) == 0) {
-        fprintf(stderr, "Failed to get necessary Sound Blaster card info\n");
-        exit(1);
+    if (fast_start) {
+        init_sb_info();
+        dsp_reset_start(sb_info.base_io_port);
+        reset_pending_port = sb_info.base_io_port;
+        open_input(path, &loudness_info);
+        reset_pending_port = -1;
+        reset_ok = dsp_reset_finish(sb_info.base_io_port);
+    } else {
+        open_input(path, &loudness_info);
+        init_sb_info();
+        reset_ok = dsp_reset(sb_info.base_io_port);
     }
 
-    if (dsp_reset(sb_info.base_io_port) == 0) {
+    if (reset_ok == 0) {
         fprintf(stderr, "Failed to reset Sound Blaster card\n");
         exit(1);
     }
+    end_phase("Reset DSP");
 
     SBInfo_get_dsp_version(&sb_info);
+    end_phase("Get DSP version");
 
     //
     // Allocate the DMA buffer.
@@ -265,17 +1001,39 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (pipeline) {
+        reader_block = (unsigned char *) malloc(dma_buf.size / 2);
+        if (reader_block == NULL ||
+            BlockRing_init(&block_ring, dma_buf.size / 2,
+                           PIPELINE_BLOCKS) == 0) {
+            fprintf(stderr, "Failed to allocate pipeline blocks\n");
+            exit(1);
+        }
+    }
+
+    // Start out at full quality. Without a normalization gain there's no work
+    // that can be shed, so the quality is never lowered.
+    QualityWatchdog_init(&watchdog, dma_buf.size / 2,
+                         gain == LOUDNESS_UNITY_GAIN ? QUALITY_FULL
+                                                     : QUALITY_CHEAP_GAIN);
+    end_phase("Allocate buffers");
+
     //
     // Print information about the Sound Blaster, the WAVE file read, and the
     // DMA buffer.
     //
 
-    printf("---- Sound Blaster info:\n");
-    SBInfo_print(&sb_info);
-    printf("\n---- Wave file info:\n");
-    WaveFileHeader_print(&wave_header);
-    printf("\n---- DMA buffer info:\n");
-    DMABuffer_print(&dma_buf);
+    if (quiet == 0) {
+        printf("---- Sound Blaster info:\n");
+        SBInfo_print(&sb_info);
+        printf("\n---- Wave file info:\n");
+        WaveFileHeader_print(&wave_header);
+        if (gain != LOUDNESS_UNITY_GAIN)
+            LoudnessInfo_print("Loudness:", &loudness_info);
+        printf("\n---- DMA buffer info:\n");
+        DMABuffer_print(&dma_buf);
+        end_phase("Print info");
+    }
 
     //
     // Register an ISR to handle the end of DMA transfers.
@@ -287,6 +1045,7 @@ int main(int argc, char *argv[])
     old_pic_mask = inp(PIC_MASK);
     irq_mask = 1 << sb_info.irq_number;
     outp(PIC_MASK, old_pic_mask & ~irq_mask);
+    end_phase("Install ISR");
 
     //
     // Program the DMA chip.
@@ -296,6 +1055,7 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Failed to program DMA\n");
         exit(1);
     }
+    end_phase("Program DMA");
 
     //
     // Read the first audio sample into the DMA buffer and start playing.
@@ -304,24 +1064,13 @@ int main(int argc, char *argv[])
     // set_mixer();
 
     playing_half = dma_buf.fill_half;
-    bytes_left = wave_header.data_size;
-
-    if (DMABuffer_fill_half_buffer(&dma_buf, file, &count) == 1) {
-        fprintf(stderr, "Couldn't fill DMA buffer\n");
-        exit(1);
-    }
-    bytes_left -= count;
 
-    if (wave_header.data_size < dma_buf.size / 2) {
-        // Can play the audio sample in a single DMA cycle
-        play(DMA_SINGLE_CYCLE, count);
-        while (playing_half == 0)
-            ;
-    } else {
-        // Need multiple DMA cycles to play the audio sample
-        play(DMA_AUTO_INIT, count);
-        play_and_refill_buffer(bytes_left);
-    }
+    if (pipeline)
+        play_pipelined();
+    else if (fast_start)
+        play_fast_start();
+    else
+        play_buffered();
 
     //
     // Cleanup.
@@ -335,7 +1084,21 @@ int main(int argc, char *argv[])
     // Restore old ISR
     _dos_setvect(sb_info.irq_number + 8, old_isr);
 
+    if (pipeline) {
+        printf("\n---- Pipeline stats:\n");
+        BlockRing_print(&block_ring);
+        BlockRing_free(&block_ring);
+        free(reader_block);
+    } else {
+        printf("\n---- Quality watchdog:\n");
+        QualityWatchdog_print(&watchdog);
+    }
+
+    printf("\n---- Startup timing:\n");
+    print_phases();
+
     DMABuffer_free(&dma_buf);
-    fclose(file);
+    if (file != stdin)
+        fclose(file);
     return 0;
 }
@@ -0,0 +1,79 @@
+//
+// timer.c
+// High resolution timing using the programmable interval timer (PIT).
+//
+
+#include "timer.h"
+#include <i86.h>
+#include <conio.h>
+
+#define PIT_COUNTER0    0x40
+#define PIT_CONTROL     0x43
+
+#define PIT_LATCH0      0x00    // Latch counter 0
+#define PIT_MODE2       0x34    // Counter 0, lo/hi byte, rate generator
+#define PIT_MODE3       0x36    // Counter 0, lo/hi byte, square wave (BIOS)
+
+//
+// Returns the BIOS tick count, incremented each time counter 0 wraps around.
+//
+static unsigned long get_bios_ticks(void)
+{
+#ifdef __386__
+    return *(unsigned long volatile *) 0x46C;
+#else
+    return *(unsigned long volatile __far *) MK_FP(0x40, 0x6C);
+#endif
+}
+
+//
+// Switches counter 0 into rate generator mode, keeping the BIOS rate of about
+// 18.2 Hz. In the BIOS's square wave mode the counter runs down twice per tick,
+// so it can't be used to tell where in the tick we are.
+//
+void timer_init(void)
+{
+    outp(PIT_CONTROL, PIT_MODE2);
+    outp(PIT_COUNTER0, 0);
+    outp(PIT_COUNTER0, 0);
+}
+
+//
+// Puts counter 0 back into the mode the BIOS uses. Leaving it in rate
+// generator mode is harmless, but this is tidier.
+//
+void timer_done(void)
+{
+    outp(PIT_CONTROL, PIT_MODE3);
+    outp(PIT_COUNTER0, 0);
+    outp(PIT_COUNTER0, 0);
+}
+
+//
+// Returns the current time in PIT ticks (TIMER_HZ per second). Wraps around
+// about once an hour, so only differences between readings are meaningful.
+//
+unsigned long timer_read(void)
+{
+    unsigned long ticks;
+    unsigned int count;
+
+    // Re-read if the BIOS tick count changed while we latched the counter
+    do {
+        ticks = get_bios_ticks();
+        outp(PIT_CONTROL, PIT_LATCH0);
+        count = inp(PIT_COUNTER0);
+        count |= inp(PIT_COUNTER0) << 8;
+    } while (ticks != get_bios_ticks());
+
+    // The counter runs down from 65536 (written as zero) each tick
+    return (ticks << 16) + ((0x10000UL - count) & 0xFFFF);
+}
+
+//
+// Converts a number of PIT ticks to milliseconds.
+//
+double timer_to_ms(unsigned long ticks)
+{
+    return ticks * 1000.0 / TIMER_HZ;
+}
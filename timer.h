@@ -0,0 +1,16 @@
+//
+// timer.h
+// High resolution timing using the programmable interval timer (PIT).
+//
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#define TIMER_HZ    1193182L    // Rate at which the PIT counts
+
+void timer_init(void);
+void timer_done(void);
+unsigned long timer_read(void);
+double timer_to_ms(unsigned long ticks);
+
+#endif
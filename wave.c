@@ -6,29 +6,167 @@
 #include "wave.h"
 #include <string.h>
 
+//
+// Reads and discards the given number of bytes. Used instead of fseek() so
+// that headers can be parsed from pipes and standard input. Return value
+// indicates whether all the bytes could be read.
+//
+static int skip_bytes(FILE *file, unsigned long count)
+{
+    char buffer[64];
+    size_t n;
+
+    while (count > 0) {
+        n = count < sizeof(buffer) ? (size_t) count : sizeof(buffer);
+        if (fread(buffer, 1, n, file) != n)
+            return 0;
+        count -= n;
+    }
+
+    return 1;
+}
+
+//
+// Reads the ID and size of the next RIFF chunk. Return value indicates whether
+// the read was successful.
+//
+static int read_chunk_header(FILE *file, char *id, unsigned long *size)
+{
+    // Read assumes we're on a little endian system
+    if (fread(id, 4, 1, file) != 1)
+        return 0;
+    if (fread(size, 4, 1, file) != 1)
+        return 0;
+    return 1;
+}
+
 //
 // Read a PCM WAVE file header from the given file. Indicate failure reading
-// failed, or file isn't of the right format.
+// failed, or file isn't of the right format. Chunks other than "fmt " and
+// "data" are skipped, and the file is never seeked, so this works on pipes.
+// On success the file is positioned at the start of the audio data.
 //
 int WaveFileHeader_read(WaveFileHeader *header, FILE *file)
 {
+    char id[4];
+    unsigned long size;
+    unsigned long offset;
+    int have_fmt = 0;
+
     // Read assumes we're on a little endian system
-    if (fread(header, sizeof(*header), 1, file) != 1)
+    if (fread(header->riff_id, 4, 1, file) != 1)
+        return 1;
+    if (fread(&header->chunk_size, 4, 1, file) != 1)
+        return 1;
+    if (fread(header->format, 4, 1, file) != 1)
         return 1;
 
     // Make sure the header info is correct
     if (memcmp(header->riff_id, "RIFF", 4))
         return 2;
-    if (memcmp(header->format, "WAVEfmt ", 8))
+    if (memcmp(header->format, "WAVE", 4))
         return 2;
-    if (header->num_channels != 2)
+
+    // Walk the chunks until we find the audio data, keeping track of how far
+    // into the file we are
+    offset = 12;
+    for (;;) {
+        if (read_chunk_header(file, id, &size) == 0)
+            return 1;
+        offset += 8;
+
+        if (memcmp(id, "fmt ", 4) == 0) {
+            if (size < WAVE_PCM_FMT_SIZE)
+                return 2;
+            memcpy(header->fmt_id, id, 4);
+            header->fmt_size = size;
+            if (fread(&header->audio_format, WAVE_PCM_FMT_SIZE, 1, file) != 1)
+                return 1;
+            // Skip any extension bytes (and the pad byte of odd-sized chunks)
+            if (skip_bytes(file, size - WAVE_PCM_FMT_SIZE + (size & 1)) == 0)
+                return 1;
+            have_fmt = 1;
+            offset += size + (size & 1);
+        } else if (memcmp(id, "data", 4) == 0) {
+            // Note: data_size may be 0 or 0xFFFFFFFF when written by a
+            // streaming encoder that couldn't go back and patch the header.
+            memcpy(header->data_id, id, 4);
+            header->data_size = size;
+            header->data_offset = offset;
+            break;
+        } else {
+            // Skip chunks we don't care about (LIST, fact, etc.)
+            if (skip_bytes(file, size + (size & 1)) == 0)
+                return 1;
+            offset += size + (size & 1);
+        }
+    }
+
+    if (have_fmt == 0)
         return 2;
-    if (memcmp(header->data_id, "data", 4))
+    if (header->num_channels != 2)
         return 2;
 
     return 0;
 }
 
+//
+// Returns whether the data size recorded in the header can be trusted.
+// Streaming encoders write 0 or 0xFFFFFFFF when the length isn't known up
+// front, in which case the audio data runs until the end of the file.
+//
+int WaveFileHeader_data_size_known(WaveFileHeader *header)
+{
+    return header->data_size != 0 && header->data_size != WAVE_UNKNOWN_SIZE;
+}
+
+//
+// Sets up a header for a PCM WAVE file with the given format and number of
+// data bytes.
+//
+void WaveFileHeader_init_pcm(WaveFileHeader *header,
+                             unsigned short num_channels,
+                             unsigned long sample_rate,
+                             unsigned short bits_per_sample,
+                             unsigned long data_size)
+{
+    memcpy(header->riff_id, "RIFF", 4);
+    header->chunk_size = WAVE_CANONICAL_HEADER_SIZE - 8 + data_size;
+    memcpy(header->format, "WAVE", 4);
+
+    memcpy(header->fmt_id, "fmt ", 4);
+    header->fmt_size = WAVE_PCM_FMT_SIZE;
+    header->audio_format = 1;
+    header->num_channels = num_channels;
+    header->sample_rate = sample_rate;
+    header->block_align = num_channels * (bits_per_sample / 8);
+    header->byte_rate = sample_rate * header->block_align;
+    header->bits_per_sample = bits_per_sample;
+
+    memcpy(header->data_id, "data", 4);
+    header->data_size = data_size;
+    header->data_offset = WAVE_CANONICAL_HEADER_SIZE;
+}
+
+//
+// Writes a PCM WAVE file header, with just the "fmt " and "data" chunks, to the
+// given file. Return value indicates whether the write was successful.
+//
+int WaveFileHeader_write(WaveFileHeader *header, FILE *file)
+{
+    // Write assumes we're on a little endian system
+    fwrite(header->riff_id, 4, 1, file);
+    fwrite(&header->chunk_size, 4, 1, file);
+    fwrite(header->format, 4, 1, file);
+    fwrite(header->fmt_id, 4, 1, file);
+    fwrite(&header->fmt_size, 4, 1, file);
+    fwrite(&header->audio_format, WAVE_PCM_FMT_SIZE, 1, file);
+    fwrite(header->data_id, 4, 1, file);
+    fwrite(&header->data_size, 4, 1, file);
+
+    return ferror(file) == 0;
+}
+
 //
 // Prints the pertinent WAVE file header attributes to stdout.
 //
@@ -39,5 +177,8 @@ void WaveFileHeader_print(WaveFileHeader *header)
     printf("Number of channels: %hd\n", header->num_channels);
     printf("Sample rate:        %ld\n", header->sample_rate);
     printf("Bits per sample:    %hd\n", header->bits_per_sample);
-    printf("Data size (bytes):  %ld\n", header->data_size);
+    if (WaveFileHeader_data_size_known(header))
+        printf("Data size (bytes):  %ld\n", header->data_size);
+    else
+        printf("Data size (bytes):  (unknown)\n");
 }
@@ -8,6 +8,10 @@
 
 #include <stdio.h>
 
+#define WAVE_PCM_FMT_SIZE   16          // Size of the PCM "fmt " fields
+#define WAVE_UNKNOWN_SIZE   0xFFFFFFFFUL // Size written by streaming encoders
+#define WAVE_CANONICAL_HEADER_SIZE 44   // Header with just "fmt " and "data"
+
 //
 // Header format for PCM WAVE files.
 //
@@ -30,9 +34,19 @@ typedef struct {
     // "data" subchunk
     char data_id[4];                // Contains the string "data"
     unsigned long data_size;        // Number of data bytes
+
+    // Not part of the file format
+    unsigned long data_offset;      // Offset of the audio data in the file
 } WaveFileHeader;
 
 int WaveFileHeader_read(WaveFileHeader *header, FILE *file);
+int WaveFileHeader_data_size_known(WaveFileHeader *header);
+void WaveFileHeader_init_pcm(WaveFileHeader *header,
+                             unsigned short num_channels,
+                             unsigned long sample_rate,
+                             unsigned short bits_per_sample,
+                             unsigned long data_size);
+int WaveFileHeader_write(WaveFileHeader *header, FILE *file);
 void WaveFileHeader_print(WaveFileHeader *header);
 
 #endif
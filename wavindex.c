@@ -0,0 +1,283 @@
+//
+// wavindex.c
+// A cache of parsed WAVE file headers, stored as a compact binary index file
+// in each directory of a WAVE file library.
+//
+
+#include "wavindex.h"
+#include "path.h"
+#include <stdio.h>
+#include <string.h>
+#include <dos.h>
+#include <io.h>
+
+//
+// Header at the start of each index file.
+//
+typedef struct {
+    char magic[4];                  // Contains the string "SBIX"
+    unsigned short version;         // WAVE_INDEX_VERSION
+    unsigned short num_entries;     // Number of entries that follow
+} WaveIndexHeader;
+
+//
+// Returns the duration in milliseconds of the given number of data bytes.
+//
+static unsigned long get_duration_ms(WaveFileHeader *header,
+                                     unsigned long data_size)
+{
+    unsigned long frame_size;
+    unsigned long frames;
+    unsigned long rate = header->sample_rate;
+
+    frame_size = (unsigned long) header->num_channels *
+                 (header->bits_per_sample / 8);
+    if (frame_size == 0 || rate == 0)
+        return 0;
+
+    // Split the division up to avoid overflowing 32 bits
+    frames = data_size / frame_size;
+    return frames / rate * 1000 + frames % rate * 1000 / rate;
+}
+
+//
+// Fills in an index entry for the given file, parsing its header. Files that
+// aren't in the correct format get an entry marked as not valid. Return value
+// indicates failure if the file couldn't be opened or read, in which case it
+// should be left out of the index, so that it's parsed again when played
+// rather than being rejected until it next changes.
+//
+static int index_file(const char *path, struct find_t *info,
+                      WaveIndexEntry *entry)
+{
+    WaveFileHeader header;
+    unsigned long data_size;
+    FILE *file;
+    int result;
+
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->name, info->name);
+    entry->file_size = info->size;
+    entry->date = info->wr_date;
+    entry->time = info->wr_time;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+
+    result = WaveFileHeader_read(&header, file);
+    if (result == 0) {
+        entry->valid = 1;
+        entry->fmt_size = header.fmt_size;
+        entry->sample_rate = header.sample_rate;
+        entry->data_offset = header.data_offset;
+        entry->data_size = header.data_size;
+        entry->audio_format = header.audio_format;
+        entry->num_channels = header.num_channels;
+        entry->bits_per_sample = header.bits_per_sample;
+
+        // Audio data of unknown size runs until the end of the file
+        data_size = entry->file_size - header.data_offset;
+        if (WaveFileHeader_data_size_known(&header) &&
+            header.data_size < data_size)
+            data_size = header.data_size;
+        entry->duration_ms = get_duration_ms(&header, data_size);
+    }
+
+    fclose(file);
+    return result != 1;
+}
+
+//
+// Writes the index file for the WAVE files in a single directory. No index
+// file is written if there are no WAVE files. Return value indicates whether
+// the index could be written.
+//
+static int index_directory(const char *dir_path, unsigned int *num_files,
+                           unsigned int *num_valid)
+{
+    char path[MAX_PATH_LEN];
+    struct find_t info;
+    WaveIndexHeader index_header;
+    WaveIndexEntry entry;
+    FILE *index = NULL;
+    int ok = 1;
+
+    memcpy(index_header.magic, "SBIX", 4);
+    index_header.version = WAVE_INDEX_VERSION;
+    index_header.num_entries = 0;
+
+    if (path_join(path, dir_path, "*.WAV") == 0)
+        return 0;
+
+    if (_dos_findfirst(path, _A_NORMAL, &info) == 0) {
+        do {
+            if (index == NULL) {
+                // Create the index file on finding the first WAVE file
+                if (path_join(path, dir_path, WAVE_INDEX_NAME) == 0)
+                    return 0;
+                index = fopen(path, "wb");
+                if (index == NULL)
+                    return 0;
+                fwrite(&index_header, sizeof(index_header), 1, index);
+            }
+
+            if (path_join(path, dir_path, info.name) == 0 ||
+                index_file(path, &info, &entry) == 0)
+                continue;
+
+            fwrite(&entry, sizeof(entry), 1, index);
+
+            index_header.num_entries++;
+            (*num_files)++;
+            if (entry.valid)
+                (*num_valid)++;
+        } while (_dos_findnext(&info) == 0);
+        _dos_findclose(&info);
+    }
+
+    if (index == NULL)
+        return 1;   // No WAVE files here
+
+    // Go back and fill in the final entry count
+    fseek(index, 0, SEEK_SET);
+    fwrite(&index_header, sizeof(index_header), 1, index);
+
+    if (ferror(index))
+        ok = 0;
+    if (fclose(index) != 0)
+        ok = 0;
+
+    return ok;
+}
+
+//
+// Recursively indexes a directory and all its subdirectories.
+//
+static int index_tree(const char *dir_path, unsigned int *num_files,
+                      unsigned int *num_valid)
+{
+    char path[MAX_PATH_LEN];
+    struct find_t info;
+    int ok;
+
+    ok = index_directory(dir_path, num_files, num_valid);
+
+    if (path_join(path, dir_path, "*.*") == 0)
+        return 0;
+
+    if (_dos_findfirst(path, _A_SUBDIR, &info) == 0) {
+        do {
+            // Skip plain files and the "." and ".." entries
+            if ((info.attrib & _A_SUBDIR) == 0 || info.name[0] == '.')
+                continue;
+
+            if (path_join(path, dir_path, info.name) == 0 ||
+                index_tree(path, num_files, num_valid) == 0)
+                ok = 0;
+        } while (_dos_findnext(&info) == 0);
+        _dos_findclose(&info);
+    }
+
+    return ok;
+}
+
+//
+// Writes an index file into the given directory and each of its
+// subdirectories, describing the WAVE files found there. Fills in the number
+// of files indexed and how many of them are playable. Return value indicates
+// whether all the index files could be written.
+//
+int WaveIndex_build(const char *dir_path, unsigned int *num_files,
+                    unsigned int *num_valid)
+{
+    *num_files = 0;
+    *num_valid = 0;
+    return index_tree(dir_path, num_files, num_valid);
+}
+
+//
+// Looks up the given file in the index file of the directory it lives in. The
+// entry is only returned if the file hasn't changed since it was indexed, as
+// judged by its size and modification time. Return value indicates whether an
+// up to date entry was found.
+//
+int WaveIndex_lookup(const char *file_path, FILE *file,
+                     WaveIndexEntry *entry)
+{
+    char path[MAX_PATH_LEN];
+    const char *name;
+    size_t dir_len;
+    WaveIndexHeader index_header;
+    unsigned short date, time;
+    unsigned int i;
+    FILE *index;
+    int found = 0;
+
+    // Split the path into directory (with trailing separator) and file name
+    name = file_path + strlen(file_path);
+    while (name > file_path && path_is_separator(name[-1]) == 0)
+        name--;
+    dir_len = name - file_path;
+
+    if (dir_len + sizeof(WAVE_INDEX_NAME) > MAX_PATH_LEN)
+        return 0;
+    memcpy(path, file_path, dir_len);
+    strcpy(path + dir_len, WAVE_INDEX_NAME);
+
+    index = fopen(path, "rb");
+    if (index == NULL)
+        return 0;
+
+    if (fread(&index_header, sizeof(index_header), 1, index) == 1 &&
+        memcmp(index_header.magic, "SBIX", 4) == 0 &&
+        index_header.version == WAVE_INDEX_VERSION) {
+        for (i = 0; i < index_header.num_entries; i++) {
+            if (fread(entry, sizeof(*entry), 1, index) != 1)
+                break;
+            if (stricmp(entry->name, name) == 0) {
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    fclose(index);
+
+    if (found == 0)
+        return 0;
+
+    // Make sure the file hasn't changed since it was indexed
+    if (_dos_getftime(fileno(file), &date, &time) != 0)
+        return 0;
+    if (date != entry->date || time != entry->time)
+        return 0;
+    if ((unsigned long) filelength(fileno(file)) != entry->file_size)
+        return 0;
+
+    return 1;
+}
+
+//
+// Fills in a WAVE file header from an index entry, as if it had been read from
+// the file itself.
+//
+void WaveIndexEntry_to_header(WaveIndexEntry *entry, WaveFileHeader *header)
+{
+    memcpy(header->riff_id, "RIFF", 4);
+    header->chunk_size = entry->file_size - 8;
+    memcpy(header->format, "WAVE", 4);
+
+    memcpy(header->fmt_id, "fmt ", 4);
+    header->fmt_size = entry->fmt_size;
+    header->audio_format = entry->audio_format;
+    header->num_channels = entry->num_channels;
+    header->sample_rate = entry->sample_rate;
+    header->block_align = entry->num_channels * (entry->bits_per_sample / 8);
+    header->byte_rate = entry->sample_rate * header->block_align;
+    header->bits_per_sample = entry->bits_per_sample;
+
+    memcpy(header->data_id, "data", 4);
+    header->data_size = entry->data_size;
+    header->data_offset = entry->data_offset;
+}
@@ -0,0 +1,42 @@
+//
+// wavindex.h
+// A cache of parsed WAVE file headers, stored as a compact binary index file
+// in each directory of a WAVE file library.
+//
+
+#ifndef WAVINDEX_H
+#define WAVINDEX_H
+
+#include "wave.h"
+
+#define WAVE_INDEX_NAME     "SBINDEX.DAT"   // Name of index file in each dir
+#define WAVE_INDEX_VERSION  1               // Bump when entry layout changes
+
+//
+// Index entry describing a single WAVE file. Fields are ordered so that the
+// layout has no padding under any structure packing, so 16-bit and 32-bit
+// builds can share index files.
+//
+typedef struct {
+    unsigned long file_size;        // File size when indexed
+    unsigned long fmt_size;         // Size of the "fmt " chunk
+    unsigned long sample_rate;      // Digital audio sample rate
+    unsigned long data_offset;      // Offset of the audio data in the file
+    unsigned long data_size;        // Number of data bytes (as in header)
+    unsigned long duration_ms;      // Duration in milliseconds
+    unsigned short date;            // DOS modification date when indexed
+    unsigned short time;            // DOS modification time when indexed
+    unsigned short audio_format;    // = 1 for uncompressed data
+    unsigned short num_channels;    // 1 = mono, 2 = stereo
+    unsigned short bits_per_sample; // 8 = 8 bits, 16 = 16 bits, etc.
+    char name[13];                  // 8.3 file name, upper case
+    unsigned char valid;            // Is the file playable?
+} WaveIndexEntry;
+
+int WaveIndex_build(const char *dir_path, unsigned int *num_files,
+                    unsigned int *num_valid);
+int WaveIndex_lookup(const char *file_path, FILE *file,
+                     WaveIndexEntry *entry);
+void WaveIndexEntry_to_header(WaveIndexEntry *entry, WaveFileHeader *header);
+
+#endif